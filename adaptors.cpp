@@ -2,6 +2,9 @@
 #include <fstream>
 #include <stdexcept>
 #include <algorithm>
+#include <cstdlib>
+#include <string.h>
+#include <unordered_set>
 #include "adaptors.hpp"
 #include "sff.hpp"
 
@@ -15,6 +18,12 @@ namespace sff
         mismatch_score(1),
         p1(&s1), 
         p2(&s2)
+    {}
+
+    AdaptorAligner::~AdaptorAligner()
+    {}
+
+    void AdaptorAligner::init_matrix()
     {
         int l1 = p1->size(); 
         int l2 = p2->size(); 
@@ -32,11 +41,9 @@ namespace sff
             scoremat[0][i] = i*gap_score;
     }
 
-    AdaptorAligner::~AdaptorAligner()
-    {}
-
     int AdaptorAligner::compute_alignment_score()
     {
+        init_matrix(); 
         int l1 = p1->size(); 
         int l2 = p2->size(); 
         int score_up, score_left, score_diag, score_match, curr_score; 
@@ -65,9 +72,479 @@ namespace sff
         return scoremat[l1][l2];
     }
 
+    int AdaptorAligner::compute_alignment_score(int maxscore)
+    {
+        int l1 = p1->size(); 
+        int l2 = p2->size(); 
+        int above = maxscore + 1;  // Any score we do not care about
+        /* Every path to the last cell uses at least |l1-l2| gaps */
+        if (std::abs(l1 - l2) * gap_score > maxscore)
+            return above; 
+        /* Only cells with |row-col| <= band can score <= maxscore */
+        int band = maxscore / gap_score; 
+        prevrow.assign(l2+1, above); 
+        currrow.assign(l2+1, above); 
+        int col; 
+        for (col = 0; col <= std::min(l2, band); col++)
+            prevrow[col] = col*gap_score; 
+        for (int row = 1; row <= l1; row++)
+        {
+            int lo = std::max(1, row - band); 
+            int hi = std::min(l2, row + band); 
+            currrow[lo-1] = (lo == 1) ? std::min(row*gap_score, above) : above; 
+            int rowmin = currrow[lo-1]; 
+            char c = (*p1)[row-1]; 
+            for (col = lo; col <= hi; col++)
+            {
+                int score_match = (c == (*p2)[col-1]) ? match_score : mismatch_score; 
+                int curr_score = std::min(
+                    prevrow[col] + gap_score, 
+                    std::min(currrow[col-1] + gap_score, 
+                             prevrow[col-1] + score_match)
+                ); 
+                curr_score = std::min(curr_score, above); 
+                currrow[col] = curr_score; 
+                rowmin = std::min(rowmin, curr_score); 
+            }
+            /* Next row reads one cell past the band from this one */
+            if (hi < l2)
+                currrow[hi+1] = above; 
+            /* Scores never decrease along a path, so once a whole row
+             * is over maxscore the last cell will be too */
+            if (rowmin > maxscore)
+                return above; 
+            prevrow.swap(currrow); 
+        }
+        return prevrow[l2]; 
+    }
+
+    /* Begin BitParallelAligner implementation */
+    /* Map a base to its Peq slot: A, C, G, T, then anything else */
+    static inline int base_code(char c)
+    {
+        switch (c)
+        {
+            case 'A': return 0; 
+            case 'C': return 1; 
+            case 'G': return 2; 
+            case 'T': return 3; 
+            default:  return 4; 
+        }
+    }
+
+    BitParallelAligner::BitParallelAligner(const std::string &adaptor) :
+        length(std::min((int)adaptor.size(), BITPARALLEL_MAX_LENGTH))
+    {
+        int i; 
+        for (i = 0; i < 5; i++)
+            peq[i] = 0; 
+        for (i = 0; i < length; i++)
+            peq[base_code(adaptor[i])] |= (uint64_t)1 << i; 
+        /* Bases outside ACGT never match, even each other */
+        peq[4] = 0; 
+    }
+
+    bool BitParallelAligner::supports(const std::string &adaptor)
+    {
+        if (adaptor.empty() || adaptor.size() > BITPARALLEL_MAX_LENGTH)
+            return false; 
+        std::string::const_iterator iter; 
+        for (iter = adaptor.begin(); iter != adaptor.end(); ++iter)
+        {
+            if (base_code(*iter) == 4)
+                return false; 
+        }
+        return true; 
+    }
+
+    inline void BitParallelAligner::advance(char c, uint64_t &Pv, 
+                                            uint64_t &Mv, int &score) const
+    {
+        /* Columns of the DP matrix are encoded as vertical deltas: 
+         * bit i of Pv (Mv) is set if D[i+1][j] - D[i][j] is +1 (-1). 
+         * score tracks the last row, D[length][j].
+         */
+        uint64_t high = (uint64_t)1 << (length-1); 
+        uint64_t Eq = peq[base_code(c)]; 
+        uint64_t Xv = Eq | Mv; 
+        uint64_t Xh = (((Eq & Pv) + Pv) ^ Pv) | Eq; 
+        uint64_t Ph = Mv | ~(Xh | Pv); 
+        uint64_t Mh = Pv & Xh; 
+        if (Ph & high)
+            score++; 
+        else if (Mh & high)
+            score--; 
+        /* First row is D[0][j] = j: it always increases by one */
+        Ph = (Ph << 1) | 1; 
+        Mh = Mh << 1; 
+        Pv = Mh | ~(Xv | Ph); 
+        Mv = Ph & Xv; 
+    }
+
+    int BitParallelAligner::compute_alignment_score(const char *text, 
+                                                    int len) const
+    {
+        return compute_alignment_score(text, len, length + len); 
+    }
+
+    int BitParallelAligner::compute_alignment_score(const char *text, 
+                                                    int len, 
+                                                    int maxscore) const
+    {
+        if (std::abs(length - len) > maxscore)
+            return maxscore + 1; 
+        uint64_t Pv = (length == 64) ? ~(uint64_t)0 
+                                     : (((uint64_t)1 << length) - 1); 
+        uint64_t Mv = 0; 
+        int score = length; 
+        for (int j = 0; j < len; j++)
+        {
+            advance(text[j], Pv, Mv, score); 
+            /* The last cell is at least score minus one per 
+             * remaining base of text */
+            if (score - (len - j - 1) > maxscore)
+                return maxscore + 1; 
+        }
+        return score; 
+    }
+
+    int BitParallelAligner::compute_aligned_end(const char *text, 
+                                                int len) const
+    {
+        /* score is D[length][j], the distance between the adaptor and
+         * text[0..j), after each column */
+        uint64_t Pv = (length == 64) ? ~(uint64_t)0 
+                                     : (((uint64_t)1 << length) - 1); 
+        uint64_t Mv = 0; 
+        int score = length; 
+        int best = score; 
+        int end = 0; 
+        for (int j = 0; j < len; j++)
+        {
+            advance(text[j], Pv, Mv, score); 
+            if (score < best || 
+                (score == best && std::abs(j+1 - length) < std::abs(end - length)))
+            {
+                best = score; 
+                end = j+1; 
+            }
+        }
+        return end; 
+    }
+
+    AdaptorPattern::AdaptorPattern(const std::string &name, 
+                                   const std::string &sequence) :
+        name(name), 
+        sequence(sequence), 
+        bitparallel(BitParallelAligner::supports(sequence)), 
+        aligner(sequence)
+    {}
+
+    /* Begin AdaptorTrie implementation */
+    #define NO_SYMBOL 255
+
+    AdaptorTrie::AdaptorTrie() :
+        patterns(NULL),
+        sigma(0),
+        max_depth(0)
+    {
+        memset(symbols, NO_SYMBOL, sizeof(symbols)); 
+    }
+
+    int AdaptorTrie::add_node()
+    {
+        children.resize(children.size() + sigma, 0); 
+        terminal.push_back(NO_PATTERN); 
+        return terminal.size() - 1; 
+    }
+
+    void AdaptorTrie::build(const std::vector<AdaptorPattern> &p)
+    {
+        std::vector<int> subset(p.size()); 
+        for (size_t i = 0; i < p.size(); i++)
+            subset[i] = i; 
+        build(p, subset); 
+    }
+
+    void AdaptorTrie::build(const std::vector<AdaptorPattern> &p, 
+                            const std::vector<int> &subset)
+    {
+        patterns = &p; 
+        memset(symbols, NO_SYMBOL, sizeof(symbols)); 
+        sigma = 0; 
+        max_depth = 0; 
+        children.clear(); 
+        terminal.clear(); 
+        /* The alphabet must be known to lay out the nodes */
+        std::vector<int>::const_iterator iter; 
+        for (iter = subset.begin(); iter != subset.end(); ++iter)
+        {
+            const std::string &sequence = p[*iter].sequence; 
+            std::string::const_iterator c; 
+            for (c = sequence.begin(); c != sequence.end(); ++c)
+            {
+                if (symbols[(unsigned char)*c] == NO_SYMBOL)
+                    symbols[(unsigned char)*c] = sigma++; 
+            }
+            max_depth = std::max(max_depth, (int)sequence.size()); 
+        }
+        add_node(); 
+        for (iter = subset.begin(); iter != subset.end(); ++iter)
+        {
+            int i = *iter; 
+            const std::string &sequence = p[i].sequence; 
+            int node = 0; 
+            for (size_t d = 0; d < sequence.size(); d++)
+            {
+                int slot = node*sigma + symbols[(unsigned char)sequence[d]]; 
+                if (children[slot] == 0)
+                {
+                    int child = add_node(); 
+                    children[slot] = child; 
+                }
+                node = children[slot]; 
+            }
+            terminal[node] = i; 
+        }
+    }
+
+    bool AdaptorTrie::empty() const
+    {
+        return (terminal.size() <= 1); 
+    }
+
+    int AdaptorTrie::get_max_depth() const
+    {
+        return max_depth; 
+    }
+
+    int AdaptorTrie::find_longest(const char *text, int len, 
+                                  std::vector<int> *hits) const
+    {
+        int longest = NO_PATTERN; 
+        int node = 0; 
+        len = std::min(len, max_depth); 
+        for (int d = 0; d < len; d++)
+        {
+            unsigned char symbol = symbols[(unsigned char)text[d]]; 
+            if (symbol == NO_SYMBOL)
+                break; 
+            node = children[node*sigma + symbol]; 
+            if (node == 0)
+                break; 
+            if (terminal[node] != NO_PATTERN)
+            {
+                longest = terminal[node]; 
+                if (hits != NULL)
+                    hits->push_back(longest); 
+            }
+        }
+        return longest; 
+    }
+
+    struct AdaptorTrie::SearchState
+    {
+        const unsigned char *text;  // read symbols
+        int len; 
+        int maxdist; 
+        int ncols;                // columns of a DP row
+        int *rows;                // one DP row per trie depth
+        int best; 
+        int bestpattern; 
+        bool ambiguous; 
+    };
+
+    int AdaptorTrie::find_closest(const char *text, int len, int maxdist, 
+                                  int &distance) const
+    {
+        SearchState state; 
+        state.len = std::min(len, max_depth); 
+        state.ncols = state.len + 1; 
+        state.maxdist = maxdist; 
+        /* Scratch reused across calls of the same thread: the read as
+         * symbols and one DP row per trie depth */
+        static thread_local std::vector<unsigned char> symboltext; 
+        static thread_local std::vector<int> rows; 
+        symboltext.resize(state.ncols); 
+        for (int j = 0; j < state.len; j++)
+            symboltext[j] = symbols[(unsigned char)text[j]]; 
+        state.text = &symboltext[0]; 
+        rows.resize((max_depth+1) * state.ncols); 
+        state.rows = &rows[0]; 
+        for (int j = 0; j < state.ncols; j++)
+            state.rows[j] = j; 
+        state.best = maxdist + 1; 
+        state.bestpattern = NO_PATTERN; 
+        state.ambiguous = false; 
+        search(0, 0, state); 
+        distance = state.best; 
+        if (state.bestpattern == NO_PATTERN)
+            return NO_PATTERN; 
+        return state.ambiguous ? AMBIGUOUS_PATTERN : state.bestpattern; 
+    }
+
+    void AdaptorTrie::search(int node, int depth, SearchState &state) const
+    {
+        const int *prev = state.rows + depth*state.ncols; 
+        int *row = state.rows + (depth+1)*state.ncols; 
+        for (int symbol = 0; symbol < sigma; symbol++)
+        {
+            int child = children[node*sigma + symbol]; 
+            if (child == 0)
+                continue; 
+            /* Row depth+1 of the DP matrix, adaptor prefix vs text */
+            row[0] = depth + 1; 
+            int rowmin = row[0]; 
+            for (int j = 1; j < state.ncols; j++)
+            {
+                int diag = prev[j-1] + (state.text[j-1] == symbol ? 0 : 1); 
+                row[j] = std::min(diag, std::min(prev[j], row[j-1]) + 1); 
+                rowmin = std::min(rowmin, row[j]); 
+            }
+            int pattern = terminal[child]; 
+            if (pattern != NO_PATTERN)
+            {
+                int score = row[std::min(depth+1, state.len)]; 
+                if (score < state.best)
+                {
+                    state.best = score; 
+                    state.bestpattern = pattern; 
+                    state.ambiguous = false; 
+                }
+                else if (score == state.best && !state.ambiguous && 
+                         state.bestpattern != NO_PATTERN && 
+                         (*patterns)[pattern].name != (*patterns)[state.bestpattern].name)
+                {
+                    state.ambiguous = true; 
+                }
+            }
+            /* Scores never decrease along a path: a subtree whose row 
+             * is above best everywhere cannot match or tie */
+            if (rowmin <= std::min(state.best, state.maxdist))
+                search(child, depth+1, state); 
+        }
+    }
+
+    /* Begin PackedHammingMatcher implementation */
+    void PackedHammingMatcher::build(const std::vector<AdaptorPattern> &p)
+    {
+        patterns = &p; 
+        max_length = 0; 
+        lo.clear(); 
+        hi.clear(); 
+        mask.clear(); 
+        lengths.clear(); 
+        packed.clear(); 
+        unpacked.clear(); 
+        for (size_t i = 0; i < p.size(); i++)
+        {
+            const std::string &sequence = p[i].sequence; 
+            int length = sequence.size(); 
+            max_length = std::max(max_length, length); 
+            if (!BitParallelAligner::supports(sequence))
+            {
+                unpacked.push_back(i); 
+                continue; 
+            }
+            uint64_t l = 0, h = 0; 
+            for (int j = 0; j < length; j++)
+            {
+                uint64_t code = base_code(sequence[j]); 
+                l |= (code & 1) << j; 
+                h |= (code >> 1) << j; 
+            }
+            lo.push_back(l); 
+            hi.push_back(h); 
+            mask.push_back(length == 64 ? ~(uint64_t)0 
+                                        : (((uint64_t)1 << length) - 1)); 
+            lengths.push_back(length); 
+            packed.push_back(i); 
+        }
+    }
+
+    int PackedHammingMatcher::get_max_length() const
+    {
+        return max_length; 
+    }
+
+    int PackedHammingMatcher::find_closest(const char *text, int len, 
+                                           int maxdist, int &distance) const
+    {
+        /* Pack the read prefix once: code bit planes, plus a plane 
+         * flagging bases outside ACGT, which never match */
+        uint64_t tlo = 0, thi = 0, tother = 0; 
+        int plen = std::min(len, BITPARALLEL_MAX_LENGTH); 
+        for (int j = 0; j < plen; j++)
+        {
+            uint64_t code = base_code(text[j]); 
+            tlo |= (code & 1) << j; 
+            thi |= ((code >> 1) & 1) << j; 
+            tother |= (uint64_t)(code == 4) << j; 
+        }
+        int best = maxdist + 1; 
+        int bestpattern = NO_PATTERN; 
+        bool ambiguous = false; 
+        size_t n = packed.size(); 
+        for (size_t a = 0; a < n; a++)
+        {
+            if (lengths[a] > len)
+                continue; 
+            uint64_t diff = ((lo[a] ^ tlo) | (hi[a] ^ thi) | tother) & mask[a]; 
+            int score = __builtin_popcountll(diff); 
+            if (score > best)
+                continue; 
+            const std::string &name = (*patterns)[packed[a]].name; 
+            if (score < best)
+            {
+                best = score; 
+                bestpattern = packed[a]; 
+                ambiguous = false; 
+            }
+            else if (!ambiguous && bestpattern != NO_PATTERN && 
+                     name != (*patterns)[bestpattern].name)
+            {
+                ambiguous = true; 
+            }
+        }
+        std::vector<int>::const_iterator iter; 
+        for (iter = unpacked.begin(); iter != unpacked.end(); ++iter)
+        {
+            const AdaptorPattern &pattern = (*patterns)[*iter]; 
+            int length = pattern.sequence.size(); 
+            if (length > len)
+                continue; 
+            int score = 0; 
+            for (int j = 0; j < length && score <= best; j++)
+                score += (text[j] != pattern.sequence[j]); 
+            if (score < best)
+            {
+                best = score; 
+                bestpattern = *iter; 
+                ambiguous = false; 
+            }
+            else if (score == best && !ambiguous && bestpattern != NO_PATTERN && 
+                     pattern.name != (*patterns)[bestpattern].name)
+            {
+                ambiguous = true; 
+            }
+        }
+        distance = best; 
+        if (bestpattern == NO_PATTERN)
+            return NO_PATTERN; 
+        return ambiguous ? AMBIGUOUS_PATTERN : bestpattern; 
+    }
+
     /* Begin AdaptorFinder implementation */
-    AdaptorFinder::AdaptorFinder(int maxmismatch) :
-        maxmismatch(maxmismatch)
+    AdaptorFinder::AdaptorFinder(int maxmismatch, 
+                                 DistanceMode mode, 
+                                 size_t neighborhood_cap, 
+                                 AdaptorEnd end) :
+        maxmismatch(maxmismatch),
+        mode(mode),
+        neighborhood_cap(neighborhood_cap),
+        end(end),
+        max_length(0),
+        indexed(false)
     {
         if (maxmismatch < 0)
             throw std::runtime_error("maxmismatch must be greater or equal than 0");
@@ -84,72 +561,439 @@ namespace sff
         std::string name, sequence;
         while (ifs >> name >> sequence)
         {
+            /* Right end adaptors are matched backwards from the end of
+             * the read */
+            if (end == RIGHT_END)
+                std::reverse(sequence.begin(), sequence.end()); 
             /* adaptors is a hash table allowing fast adaptor sequence lookup
              * length_of_adaptor -> adaptor_sequence -> adaptor_name
              */
             adaptors[sequence.size()].insert(std::make_pair(sequence, name)); 
+            max_length = std::max(max_length, (int)sequence.size()); 
         }
         ifs.close();
-        return true;
-    }
 
-    bool AdaptorFinder::find(const SFFField &field,
-                             std::string &match)
-    {
+        /* Prepare imperfect matching, in the same order as the 
+         * hash tables are walked */
+        patterns.clear(); 
         adaptormap::const_iterator sizeiter; 
         stringmap::const_iterator striter;
-        std::string sequence; 
         for (sizeiter = adaptors.begin(); sizeiter != adaptors.end(); ++sizeiter)
         {
-            sequence = field.get_left_adaptor_sequence(sizeiter->first); 
-            /* First check if adaptor runs over to actual read.
-             * If yes, then we consider the adaptor does not match.
-             */
-            if (sequence.size() < sizeiter->first)
-                continue;
-            striter = sizeiter->second.find(sequence); 
-            if (striter != sizeiter->second.end())
+            for (striter = sizeiter->second.begin(); 
+                 striter != sizeiter->second.end(); 
+                 ++striter)
+                patterns.push_back(AdaptorPattern(striter->second, striter->first)); 
+        }
+        trie.build(patterns); 
+        std::vector<int> unaligned; 
+        for (size_t i = 0; i < patterns.size(); i++)
+        {
+            if (!patterns[i].bitparallel)
+                unaligned.push_back(i); 
+        }
+        longtrie.build(patterns, unaligned); 
+        /* Substitutions are counted on packed adaptors, faster than
+         * probing an index of their variants */
+        if (mode == HAMMING)
+            hamming.build(patterns); 
+        else if (maxmismatch > 0)
+            indexed = build_neighborhood(); 
+        return true;
+    }
+
+    bool AdaptorFinder::has_neighborhood_index() const
+    {
+        return indexed; 
+    }
+
+    /* Symbols used to generate variants. N is included so that reads
+     * with uncalled bases are found in the index */
+    static const char VARIANT_ALPHABET[] = "ACGTN"; 
+    static const int VARIANT_ALPHABET_SIZE = 5; 
+
+    /* Whether the len bases are all in VARIANT_ALPHABET. Others, like
+     * IUPAC codes or lowercase bases, are in no variant */
+    static bool in_variant_alphabet(const char *bases, int len)
+    {
+        for (int i = 0; i < len; i++)
+        {
+            switch (bases[i])
             {
-                /* We found a perfect match */
-                match = striter->second; 
-                return true; 
+                case 'A': case 'C': case 'G': case 'T': case 'N': 
+                    break; 
+                default: 
+                    return false; 
             }
         }
+        return true; 
+    }
+
+    /* Expand every adaptor into all sequences within maxmismatch 
+     * edits, one breadth-first level 
+     * per edit so the level of a variant is its exact distance. Only 
+     * variants as long as the adaptor or shorter are kept: that is all
+     * find_imperfect can compare against it. Gives up, leaving the index empty, as soon
+     * as the index would exceed neighborhood_cap sequences.
+     */
+    bool AdaptorFinder::build_neighborhood()
+    {
+        neighborhood.clear(); 
+        if (neighborhood_cap == 0)
+            return false; 
+        size_t total = 0; 
+        for (size_t p = 0; p < patterns.size(); p++)
+        {
+            const std::string &adaptor = patterns[p].sequence; 
+            int length = adaptor.size(); 
+            neighbormap &variants = neighborhood[length]; 
+            std::unordered_set<std::string> seen; 
+            std::vector<std::string> level(1, adaptor), next; 
+            seen.insert(adaptor); 
+            for (int distance = 0; distance <= maxmismatch; distance++)
+            {
+                std::vector<std::string>::const_iterator iter; 
+                for (iter = level.begin(); iter != level.end(); ++iter)
+                {
+                    if (iter->size() > (size_t)length)
+                        continue; 
+                    Neighbor candidate = { (int)p, distance }; 
+                    std::pair<neighbormap::iterator, bool> inserted = 
+                        variants.insert(std::make_pair(*iter, candidate)); 
+                    if (inserted.second)
+                    {
+                        if (++total > neighborhood_cap)
+                        {
+                            neighborhood.clear(); 
+                            return false; 
+                        }
+                        continue; 
+                    }
+                    Neighbor &current = inserted.first->second; 
+                    if (distance < current.distance)
+                        current = candidate; 
+                    else if (distance == current.distance && 
+                             (current.pattern == AMBIGUOUS_PATTERN || 
+                              patterns[current.pattern].name != patterns[p].name))
+                        current.pattern = AMBIGUOUS_PATTERN; 
+                }
+                if (distance == maxmismatch)
+                    break; 
+                /* Single edits of this level make up the next one */
+                next.clear(); 
+                for (iter = level.begin(); iter != level.end(); ++iter)
+                {
+                    const std::string &v = *iter; 
+                    for (size_t i = 0; i <= v.size(); i++)
+                    {
+                        std::string edited; 
+                        if (i < v.size())
+                        {
+                            /* deletion */
+                            edited = v; 
+                            edited.erase(i, 1); 
+                            if (seen.insert(edited).second)
+                                next.push_back(edited); 
+                        }
+                        for (int a = 0; a < VARIANT_ALPHABET_SIZE; a++)
+                        {
+                            char c = VARIANT_ALPHABET[a]; 
+                            /* insertion */
+                            edited = v; 
+                            edited.insert(edited.begin()+i, c); 
+                            if (seen.insert(edited).second)
+                                next.push_back(edited); 
+                            /* substitution */
+                            if (i < v.size() && v[i] != c)
+                            {
+                                edited = v; 
+                                edited[i] = c; 
+                                if (seen.insert(edited).second)
+                                    next.push_back(edited); 
+                            }
+                        }
+                    }
+                    if (seen.size() > neighborhood_cap)
+                    {
+                        neighborhood.clear(); 
+                        return false; 
+                    }
+                }
+                level.swap(next); 
+            }
+        }
+        return true; 
+    }
+
+    bool AdaptorFinder::find(const SFFField &field,
+                             std::string &match, 
+                             MatchStats *stats, 
+                             AdaptorSpan *span)
+    {
+        if (span != NULL)
+        {
+            span->left = 0; 
+            span->right = field.get_view().nbases; 
+        }
+        int distance; 
+        bool found = find(field, match, distance, span); 
+        if (stats != NULL && found && distance == 0)
+            stats->perfect++; 
+        else if (stats != NULL && found)
+            stats->add_imperfect(distance); 
+        else if (stats != NULL)
+            stats->unmatched++; 
+        return found;
+    }
+
+    bool AdaptorFinder::find(const SFFField &field, 
+                             std::string &match, 
+                             int &distance, 
+                             AdaptorSpan *span)
+    {
+        const char *bases; 
+        int pattern; 
+        /* Insertions may push the end of an adaptor past its length */
+        int size = max_length + maxmismatch; 
+        if (end == LEFT_END)
+        {
+            int len = field.get_left_adaptor_bases(size, &bases); 
+            if (!find_bases(bases, len, match, distance, pattern))
+                return false; 
+            if (span != NULL)
+                span->left = bases - field.get_view().bases + 
+                             get_match_length(bases, len, pattern, distance); 
+            return true; 
+        }
+        /* The end of the read, backwards, is matched against the 
+         * reversed adaptors like the left end is */
+        int len = field.get_right_adaptor_bases(size, &bases); 
+        char local[BITPARALLEL_MAX_LENGTH]; 
+        std::vector<char> allocated; 
+        char *reversed = local; 
+        if (len > BITPARALLEL_MAX_LENGTH)
+        {
+            allocated.resize(len); 
+            reversed = &allocated[0]; 
+        }
+        std::reverse_copy(bases, bases + len, reversed); 
+        if (!find_bases(reversed, len, match, distance, pattern))
+            return false; 
+        if (span != NULL)
+            span->right = bases + len - field.get_view().bases - 
+                          get_match_length(reversed, len, pattern, distance); 
+        return true; 
+    }
+
+    int AdaptorFinder::get_match_length(const char *bases, int len, 
+                                        int pattern, int distance) const
+    {
+        const AdaptorPattern &adaptor = patterns[pattern]; 
+        int length = std::min(len, (int)adaptor.sequence.size()); 
+        if (distance == 0 || mode == HAMMING || !adaptor.bitparallel)
+            return length; 
+        /* The adaptor ends within distance bases of its length */
+        return adaptor.aligner.compute_aligned_end(
+                bases, std::min(len, length + distance)); 
+    }
+
+    bool AdaptorFinder::find_bases(const char *bases, int len, 
+                                   std::string &match, int &distance, 
+                                   int &pattern)
+    {
+        /* Walk the trie with the bases of the adaptor end. When 
+         * several adaptors match, the longest one wins.
+         */
+        pattern = trie.find_longest(bases, 
+                                    std::min(len, trie.get_max_depth())); 
+        if (pattern != NO_PATTERN)
+        {
+            /* We found a perfect match */
+            match = patterns[pattern].name; 
+            distance = 0; 
+            return true; 
+        }
         /* We have not found a perfect match. 
          * Attempt to find an imperfect one.
          */
-        if (maxmismatch > 0)
-            return find_imperfect(field, match); 
-        return false;
+        if (maxmismatch == 0)
+            return false; 
+        if (mode == HAMMING)
+            return find_hamming(bases, len, match, distance, pattern); 
+        /* Bases outside the alphabet of the index are mismatches to 
+         * the aligners, as to any other base */
+        if (indexed && in_variant_alphabet(bases, std::min(len, max_length)))
+            return find_indexed(bases, len, match, distance, pattern); 
+        return find_imperfect(bases, len, match, distance, pattern); 
     }
 
-    /* Look for imperfect match using Levenstein distance */
-    bool AdaptorFinder::find_imperfect(const SFFField &field, 
-                                       std::string &match)
+    /* Look for imperfect match in the neighborhood index */
+    bool AdaptorFinder::find_indexed(const char *bases, int len, 
+                                     std::string &match, int &distance, 
+                                     int &pattern)
     {
-        adaptormap::const_iterator sizeiter; 
-        stringmap::const_iterator striter;
+        neighborhoodmap::const_iterator sizeiter; 
+        neighbormap::const_iterator variant; 
         int best = maxmismatch+1;
-        int alignment = 0;
+        int bestpattern = NO_PATTERN; 
+        bool ambiguous = false; 
         std::string sequence;
-        for (sizeiter = adaptors.begin(); 
-             sizeiter != adaptors.end(); 
+        for (sizeiter = neighborhood.begin(); 
+             sizeiter != neighborhood.end(); 
              ++sizeiter)
         {
-            sequence = field.get_left_adaptor_sequence(sizeiter->first); 
-            for (striter = sizeiter->second.begin();
-                 striter != sizeiter->second.end(); 
-                 ++striter)
+            sequence.assign(bases, std::min(len, sizeiter->first)); 
+            variant = sizeiter->second.find(sequence); 
+            if (variant == sizeiter->second.end())
+                continue; 
+            const Neighbor &neighbor = variant->second; 
+            if (neighbor.distance < best)
+            {
+                best = neighbor.distance; 
+                bestpattern = neighbor.pattern; 
+                ambiguous = (neighbor.pattern == AMBIGUOUS_PATTERN); 
+            }
+            else if (neighbor.distance == best && !ambiguous && 
+                     (neighbor.pattern == AMBIGUOUS_PATTERN || 
+                      patterns[neighbor.pattern].name != patterns[bestpattern].name))
+            {
+                ambiguous = true; 
+            }
+        }
+        if (best > maxmismatch || ambiguous)
+            return false; 
+        match = patterns[bestpattern].name; 
+        distance = best; 
+        pattern = bestpattern; 
+        return true; 
+    }
+
+    /* Look for imperfect match counting substitutions only */
+    bool AdaptorFinder::find_hamming(const char *bases, int len, 
+                                     std::string &match, int &distance, 
+                                     int &pattern)
+    {
+        pattern = hamming.find_closest(bases, 
+                                       std::min(len, hamming.get_max_length()), 
+                                       maxmismatch, distance); 
+        if (pattern == NO_PATTERN || pattern == AMBIGUOUS_PATTERN)
+            return false; 
+        match = patterns[pattern].name; 
+        return true; 
+    }
+
+    /* Look for imperfect match using Levenstein distance */
+    bool AdaptorFinder::find_imperfect(const char *bases, int len, 
+                                       std::string &match, int &distance, 
+                                       int &pattern)
+    {
+        std::vector<AdaptorPattern>::const_iterator iter; 
+        int best = maxmismatch+1;
+        int alignment = 0;
+        bool ambiguous = false; 
+        std::string bestname; 
+        int bestpattern = NO_PATTERN; 
+        for (iter = patterns.begin(); iter != patterns.end(); ++iter)
+        {
+            if (!iter->bitparallel)
+                continue; 
+            /* Only a score up to best matters (equal means ambiguous),
+             * so alignments give up as soon as they cannot reach it */
+            int bound = std::min(best, maxmismatch); 
+            int compared = std::min(len, (int)iter->sequence.size()); 
+            alignment = iter->aligner.compute_alignment_score(bases, compared, 
+                                                              bound); 
+            if (alignment < best)
             {
-                AdaptorAligner sw(sequence, striter->first); 
-                alignment = sw.compute_alignment_score();
-                if (alignment < best)
+                best = alignment;
+                bestname = iter->name;
+                bestpattern = iter - patterns.begin(); 
+                ambiguous = false; 
+            }
+            else if (alignment == best && iter->name != bestname)
+            {
+                ambiguous = true; 
+            }
+        }
+        if (!longtrie.empty())
+        {
+            int found = longtrie.find_closest(bases, 
+                                              std::min(len, longtrie.get_max_depth()), 
+                                              std::min(best, maxmismatch), 
+                                              alignment); 
+            if (found != NO_PATTERN && alignment < best)
+            {
+                best = alignment; 
+                ambiguous = (found == AMBIGUOUS_PATTERN); 
+                if (!ambiguous)
                 {
-                    best = alignment;
-                    match = striter->second;
+                    bestname = patterns[found].name; 
+                    bestpattern = found; 
                 }
             }
+            else if (found != NO_PATTERN && alignment == best && 
+                     (found == AMBIGUOUS_PATTERN || 
+                      patterns[found].name != bestname))
+            {
+                ambiguous = true; 
+            }
         }
-        return (best <= maxmismatch); 
+        if (best > maxmismatch || ambiguous)
+            return false; 
+        match = bestname; 
+        distance = best; 
+        pattern = bestpattern; 
+        return true; 
+    }
+
+    /* Begin PairedAdaptorFinder implementation */
+    PairedAdaptorFinder::PairedAdaptorFinder(int maxmismatch, 
+                                             DistanceMode mode, 
+                                             size_t neighborhood_cap) :
+        left(maxmismatch, mode, neighborhood_cap, LEFT_END),
+        right(maxmismatch, mode, neighborhood_cap, RIGHT_END)
+    {}
+
+    PairedAdaptorFinder::~PairedAdaptorFinder()
+    {}
+
+    bool PairedAdaptorFinder::read(const std::string &leftfilename, 
+                                   const std::string &rightfilename)
+    {
+        return left.read(leftfilename) && right.read(rightfilename); 
+    }
+
+    bool PairedAdaptorFinder::find(const SFFField &field, 
+                                   std::string &match, 
+                                   MatchStats *stats, 
+                                   AdaptorSpan *span)
+    {
+        if (span != NULL)
+        {
+            span->left = 0; 
+            span->right = field.get_view().nbases; 
+        }
+        std::string rightmatch; 
+        int leftdistance, rightdistance; 
+        /* The right end is only looked at when the left one matched */
+        bool found = left.find(field, match, leftdistance, span) && 
+                     right.find(field, rightmatch, rightdistance, span); 
+        if (found)
+        {
+            match += PAIR_SEPARATOR; 
+            match += rightmatch; 
+        }
+        if (stats != NULL && found && leftdistance + rightdistance == 0)
+            stats->perfect++; 
+        else if (stats != NULL && found)
+            stats->add_imperfect(leftdistance + rightdistance); 
+        else if (stats != NULL)
+            stats->unmatched++; 
+        return found; 
+    }
+
+    bool PairedAdaptorFinder::has_neighborhood_index() const
+    {
+        return left.has_neighborhood_index() && right.has_neighborhood_index(); 
     }
 }
@@ -4,9 +4,20 @@
 #include <unordered_map>
 #include <string>
 #include <vector>
+#include <stdint.h>
 #include "sff.hpp"
+#include "stats.hpp"
 
 #define UNMATCHED "unmatched"
+/* Between the left and right adaptor names of a pair */
+#define PAIR_SEPARATOR "+"
+/* Longest adaptor handled by the bit-parallel aligner (one word) */
+#define BITPARALLEL_MAX_LENGTH 64
+/* Default cap on the number of precomputed neighbours */
+#define DEFAULT_NEIGHBORHOOD_CAP 1000000
+/* Pattern lookups: no adaptor found, or several equally good ones */
+#define NO_PATTERN -1
+#define AMBIGUOUS_PATTERN -2
 
 namespace sff
 {
@@ -20,16 +31,162 @@ namespace sff
             ~AdaptorAligner(); 
 
             int compute_alignment_score(); 
+            /* Bounded alignment: the exact score if it is at most 
+             * maxscore, maxscore+1 otherwise. Only the diagonal band of
+             * width 2*maxscore+1 is evaluated, two rows at a time, and 
+             * the alignment stops as soon as a whole row is above 
+             * maxscore (Ukkonen cut-off).
+             */
+            int compute_alignment_score(int maxscore); 
 
         private: 
+            void init_matrix(); 
             int match_score; 
             int gap_score;
             int mismatch_score;
             intmatrix scoremat; 
+            std::vector<int> prevrow; 
+            std::vector<int> currrow; 
             const std::string *p1;
             const std::string *p2; 
     };
 
+    /* Bit-parallel edit distance (Myers/Hyyro) against one adaptor of
+     * at most BITPARALLEL_MAX_LENGTH bases over the ACGT alphabet. The adaptor's 
+     * match masks (Peq) are computed once, after which each 
+     * comparison costs a few word operations per base and no 
+     * allocation. Scores are the same as AdaptorAligner's.
+     */
+    class BitParallelAligner
+    {
+        public: 
+            BitParallelAligner(const std::string &adaptor); 
+            /* Whether adaptor can be handled by this engine */
+            static bool supports(const std::string &adaptor); 
+
+            /* Levenshtein distance between adaptor and text[0..len) */
+            int compute_alignment_score(const char *text, int len) const; 
+            /* Same, but gives up with maxscore+1 once the distance is
+             * known to exceed maxscore */
+            int compute_alignment_score(const char *text, int len, 
+                                        int maxscore) const; 
+            /* Number of bases of text[0..len) the whole adaptor aligns
+             * best with: the prefix at the smallest distance, the one
+             * closest to the adaptor length on ties */
+            int compute_aligned_end(const char *text, int len) const; 
+
+        private: 
+            /* One column of the DP matrix, for base c of the text */
+            void advance(char c, uint64_t &Pv, uint64_t &Mv, 
+                         int &score) const; 
+            /* One mask per base, the last one for anything else */
+            uint64_t peq[5]; 
+            int length; 
+    };
+
+    /* One adaptor prepared for imperfect matching */
+    struct AdaptorPattern
+    {
+        AdaptorPattern(const std::string &name, const std::string &sequence); 
+        std::string name; 
+        std::string sequence; 
+        bool bitparallel;  // Use aligner rather than AdaptorAligner 
+        BitParallelAligner aligner; 
+    };
+
+    /* Prefix trie over all adaptor sequences, stored as a flat array:
+     * the child of node n for symbol s is children[n*sigma+s], 0 when
+     * there is none (the root, node 0, is nobody's child). Symbols are
+     * the characters found in adaptors; any other character of a read
+     * falls off the trie. A read is walked once for all adaptor 
+     * lengths instead of once per length.
+     */
+    class AdaptorTrie
+    {
+        public: 
+            AdaptorTrie(); 
+            /* Build over all patterns, or only those listed in subset */
+            void build(const std::vector<AdaptorPattern> &patterns); 
+            void build(const std::vector<AdaptorPattern> &patterns, 
+                       const std::vector<int> &subset); 
+            bool empty() const; 
+            int get_max_depth() const; 
+
+            /* Longest adaptor text starts with, as an index in 
+             * patterns, or NO_PATTERN. Every adaptor text starts with is 
+             * appended to hits, shortest first, when hits is given. 
+             */
+            int find_longest(const char *text, int len, 
+                             std::vector<int> *hits=NULL) const; 
+
+            /* Closest adaptor within maxdist edits, comparing each 
+             * adaptor with the first min(adaptor length, len) bases of
+             * text like AdaptorFinder does. Subtrees are abandoned as 
+             * soon as a whole DP row exceeds the best distance found.
+             * Returns the pattern, AMBIGUOUS_PATTERN if differently 
+             * named adaptors are equally close, or NO_PATTERN if none is 
+             * within maxdist. distance is set to the best distance.
+             */
+            int find_closest(const char *text, int len, int maxdist, 
+                             int &distance) const; 
+
+        private: 
+            int add_node(); 
+            struct SearchState; 
+            void search(int node, int depth, SearchState &state) const; 
+            const std::vector<AdaptorPattern> *patterns; 
+            unsigned char symbols[256];  // character -> symbol
+            int sigma; 
+            int max_depth; 
+            std::vector<int> children; 
+            std::vector<int> terminal;   // pattern ending at node, or NO_PATTERN
+    };
+
+    /* Substitution-only matching for -M hamming. Adaptors of at most
+     * BITPARALLEL_MAX_LENGTH ACGT bases are packed once into two bit
+     * planes (2-bit codes) stored adaptor by adaptor in flat arrays.
+     * A read prefix is packed once per lookup, then the distance to 
+     * each adaptor is a pair of XORs and a popcount. Reads may only 
+     * match adaptors they fully cover; any base outside ACGT in the 
+     * read is a mismatch. Other adaptors are compared base by base.
+     */
+    class PackedHammingMatcher
+    {
+        public: 
+            void build(const std::vector<AdaptorPattern> &patterns); 
+            int get_max_length() const; 
+
+            /* Same contract as AdaptorTrie::find_closest */
+            int find_closest(const char *text, int len, int maxdist, 
+                             int &distance) const; 
+
+        private: 
+            const std::vector<AdaptorPattern> *patterns; 
+            int max_length; 
+            /* One entry per packed adaptor */
+            std::vector<uint64_t> lo;     // low bit of each base code
+            std::vector<uint64_t> hi;     // high bit of each base code
+            std::vector<uint64_t> mask;   // one bit per adaptor base
+            std::vector<int> lengths; 
+            std::vector<int> packed;      // index in patterns
+            std::vector<int> unpacked;    // compared base by base
+    };
+
+    /* Entry of the mismatch-neighborhood index: the adaptor pattern
+     * closest to a variant sequence and its distance. pattern is 
+     * AMBIGUOUS_PATTERN when adaptors with different names are 
+     * equally close.
+     */
+    struct Neighbor
+    {
+        int pattern; 
+        int distance; 
+    };
+    /* variant sequence -> closest adaptor */
+    typedef std::unordered_map<std::string, Neighbor> neighbormap; 
+    /* adaptor length -> variants of adaptors of that length */
+    typedef std::unordered_map<int, neighbormap> neighborhoodmap; 
+
     /* constant time access string->string dictionary. Stores
      * adapter sequence -> adapter name
      */
@@ -39,13 +196,71 @@ namespace sff
      */
     typedef std::unordered_map<int, stringmap> adaptormap; 
 
+    /* Distance used for imperfect matches */
+    enum DistanceMode
+    {
+        LEVENSHTEIN,  // substitutions, insertions and deletions
+        HAMMING       // substitutions only
+    };
+
+    /* End of the read an adaptor is looked for at */
+    enum AdaptorEnd
+    {
+        LEFT_END,   // bases between the key and the left clip
+        RIGHT_END   // last bases, past the right clip if any
+    };
+
+    /* Bases of a read left of left and from right on are taken by the
+     * adaptors found, 0-based. Without adaptor at an end, the span 
+     * reaches that end of the read */
+    struct AdaptorSpan
+    {
+        int left; 
+        int right; 
+    };
+
+    /* Interface of the adaptor lookups the splitter can use */
+    class VirtualAdaptorFinder
+    {
+        public: 
+            virtual ~VirtualAdaptorFinder() {}
+            /* Look if field matches, setting match to the name of 
+             * the output of the read. Else, match is left unspecified
+             * and we return false. The outcome is counted in stats,
+             * if given. Each thread should have its own. Where the 
+             * adaptors are is set in span, if given */
+            virtual bool find(const SFFField &field, 
+                              std::string &match, 
+                              MatchStats *stats=NULL, 
+                              AdaptorSpan *span=NULL) = 0; 
+            /* Whether imperfect lookups use the neighborhood index */
+            virtual bool has_neighborhood_index() const = 0; 
+    };
+
     /* Class to search for a match between a provided adaptor sequence 
      * and the list of adaptors we wish to split on. 
+     * An imperfect match is the adaptor at the smallest distance, up to
+     * maxmismatch. If adaptors with different names share that 
+     * distance, the read is ambiguous and left unmatched.
+     * Distances are Levenshtein by default, or count substitutions 
+     * only in HAMMING mode, where the read is compared to packed 
+     * adaptors (PackedHammingMatcher).
+     * With Levenshtein distances and a small maxmismatch, every 
+     * sequence within maxmismatch edits of an adaptor is precomputed
+     * in a hash table, so imperfect lookups cost one probe per adaptor
+     * length. If that index would hold more than neighborhood_cap 
+     * sequences, imperfect lookups align the read against every 
+     * adaptor instead.
+     * At the RIGHT_END, the adaptors and the end of the read are both
+     * reversed, so that they are matched with the same lookups.
      */
-    class AdaptorFinder
+    class AdaptorFinder : public VirtualAdaptorFinder
     {
         public:
-            AdaptorFinder(int maxmismatch); 
+            AdaptorFinder(int maxmismatch, 
+                          DistanceMode mode=LEVENSHTEIN, 
+                          size_t neighborhood_cap=DEFAULT_NEIGHBORHOOD_CAP, 
+                          AdaptorEnd end=LEFT_END); 
             ~AdaptorFinder(); 
 
             /* Read a list of adaptors from tab-separated file */
@@ -53,15 +268,90 @@ namespace sff
 
             /* Look if field matches one of the adaptors 
              * If a match is found, then the adaptor name is stored 
-             * in match. Else, match is set to UNMATCHED and we return false*/
+             * in match. Else, match is set to UNMATCHED and we return false.
+             * The outcome is counted in stats, if given. Each thread
+             * should have its own */
+            bool find(const SFFField &field, 
+                      std::string &match, 
+                      MatchStats *stats=NULL, 
+                      AdaptorSpan *span=NULL); 
+            /* Same, giving the distance of the match, 0 when perfect.
+             * Only the end of span this finder looks at is set */
             bool find(const SFFField &field, 
-                      std::string &match); 
+                      std::string &match, 
+                      int &distance, 
+                      AdaptorSpan *span); 
+
+            /* Whether imperfect lookups use the neighborhood index */
+            bool has_neighborhood_index() const; 
 
         private: 
             int maxmismatch;
+            DistanceMode mode; 
+            size_t neighborhood_cap; 
+            AdaptorEnd end; 
+            int max_length;  // Longest adaptor
             adaptormap adaptors;
-            bool find_imperfect(const SFFField &field, 
-                                std::string &match);
+            /* Adaptors in lookup order, with precomputed aligners */
+            std::vector<AdaptorPattern> patterns; 
+            AdaptorTrie trie; 
+            /* Adaptors BitParallelAligner cannot handle. Walking them 
+             * as a trie shares the DP rows of common prefixes */
+            AdaptorTrie longtrie; 
+            PackedHammingMatcher hamming; 
+            neighborhoodmap neighborhood; 
+            bool indexed; 
+            bool build_neighborhood(); 
+            /* Lookup of the adaptor bases at the end of the read, 
+             * nearest to the end first. pattern is set to the adaptor
+             * matched */
+            bool find_bases(const char *bases, int len, 
+                            std::string &match, int &distance, int &pattern); 
+            /* Imperfect lookups, distance is set to that of the match */
+            bool find_imperfect(const char *bases, int len, 
+                                std::string &match, int &distance, 
+                                int &pattern);
+            bool find_indexed(const char *bases, int len, 
+                              std::string &match, int &distance, 
+                              int &pattern);
+            bool find_hamming(const char *bases, int len, 
+                              std::string &match, int &distance, 
+                              int &pattern);
+            /* Number of bases taken by the adaptor of a match: its 
+             * length, or the end of its alignment with the bases for
+             * imperfect Levenshtein matches */
+            int get_match_length(const char *bases, int len, 
+                                 int pattern, int distance) const;
+    };
+
+    /* Dual-end lookup, for reads carrying an adaptor at each end: the
+     * left adaptors are looked for at the left end, and the right 
+     * ones at the right end of the same field. A read matches when 
+     * both ends do, and goes to the output of that combination, 
+     * named '<left>PAIR_SEPARATOR<right>'. Its distance is the sum of
+     * the distances at both ends.
+     */
+    class PairedAdaptorFinder : public VirtualAdaptorFinder
+    {
+        public: 
+            PairedAdaptorFinder(int maxmismatch, 
+                                DistanceMode mode=LEVENSHTEIN, 
+                                size_t neighborhood_cap=DEFAULT_NEIGHBORHOOD_CAP); 
+            ~PairedAdaptorFinder(); 
+
+            /* Read both lists of adaptors, in the format of 
+             * AdaptorFinder::read */
+            bool read(const std::string &leftfilename, 
+                      const std::string &rightfilename); 
+            bool find(const SFFField &field, 
+                      std::string &match, 
+                      MatchStats *stats=NULL, 
+                      AdaptorSpan *span=NULL); 
+            bool has_neighborhood_index() const; 
+
+        private: 
+            AdaptorFinder left; 
+            AdaptorFinder right; 
     };
 }
 #endif
@@ -0,0 +1,134 @@
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <zlib.h>
+#include "bgzf.hpp"
+
+/* gzip header with the BGZF extra field, and crc32 and size trailer */
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+
+namespace sff
+{
+    static inline void store_le16(char *p, uint16_t v)
+    {
+        p[0] = (char)(v & 0xff);
+        p[1] = (char)(v >> 8);
+    }
+
+    static inline void store_le32(char *p, uint32_t v)
+    {
+        store_le16(p, v & 0xffff);
+        store_le16(p+2, v >> 16);
+    }
+
+    BGZFCompressor::BGZFCompressor(int level, int nthreads) :
+        level(level),
+        tasks(4*nthreads)
+    {
+        for (int t = 0; t < nthreads; t++)
+            workers.push_back(std::thread(&BGZFCompressor::run, this));
+    }
+
+    BGZFCompressor::~BGZFCompressor()
+    {
+        tasks.close();
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+    }
+
+    void BGZFCompressor::run()
+    {
+        Task task;
+        while (tasks.pop(task))
+        {
+            bool ok = compress_block(task.data, task.len, level, *task.out);
+            std::lock_guard<std::mutex> lock(task.batch->mutex);
+            task.batch->ok = task.batch->ok && ok;
+            if (--task.batch->pending == 0)
+                task.batch->done.notify_all();
+        }
+    }
+
+    bool BGZFCompressor::compress(const char *data, size_t len,
+                                  std::vector<char> &out)
+    {
+        size_t nblocks = (len + BGZF_BLOCK_SIZE - 1) / BGZF_BLOCK_SIZE;
+        std::vector<std::vector<char> > blocks(nblocks);
+        Batch batch;
+        batch.pending = nblocks;
+        batch.ok = true;
+        for (size_t b = 0; b < nblocks; b++)
+        {
+            size_t start = b * BGZF_BLOCK_SIZE;
+            Task task = {data + start,
+                         std::min((size_t)BGZF_BLOCK_SIZE, len - start),
+                         &blocks[b], &batch};
+            if (!tasks.push(task))
+                return false;
+        }
+        std::unique_lock<std::mutex> lock(batch.mutex);
+        while (batch.pending > 0)
+            batch.done.wait(lock);
+        /* Blocks go to the output in input order */
+        for (size_t b = 0; b < nblocks; b++)
+            out.insert(out.end(), blocks[b].begin(), blocks[b].end());
+        return batch.ok;
+    }
+
+    bool BGZFCompressor::compress_stored(const char *data, size_t len,
+                                         std::vector<char> &out)
+    {
+        if (len > BGZF_BLOCK_SIZE)
+            return false;
+        return compress_block(data, len, Z_NO_COMPRESSION, out);
+    }
+
+    void BGZFCompressor::eof_block(std::vector<char> &out)
+    {
+        compress_block(NULL, 0, Z_DEFAULT_COMPRESSION, out);
+    }
+
+    bool BGZFCompressor::compress_block(const char *data, size_t len,
+                                        int level, std::vector<char> &out)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        /* Raw deflate, the gzip framing is written by hand */
+        if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        out.resize(BGZF_HEADER_SIZE + deflateBound(&zs, len) +
+                   BGZF_FOOTER_SIZE);
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs.avail_in = len;
+        zs.next_out = reinterpret_cast<Bytef*>(&out[BGZF_HEADER_SIZE]);
+        zs.avail_out = out.size() - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+        int ret = deflate(&zs, Z_FINISH);
+        size_t csize = zs.total_out;
+        deflateEnd(&zs);
+        if (ret != Z_STREAM_END)
+            return false;
+        size_t bsize = BGZF_HEADER_SIZE + csize + BGZF_FOOTER_SIZE;
+        if (bsize > BGZF_MAX_BLOCK_SIZE)
+            /* Did not compress, store it */
+            return compress_block(data, len, Z_NO_COMPRESSION, out);
+        out.resize(bsize);
+
+        /* gzip member with FEXTRA, the "BC" subfield giving the size
+         * of the whole block minus one */
+        static const unsigned char header[12] = {
+            31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0};
+        memcpy(&out[0], header, sizeof(header));
+        out[12] = 'B';
+        out[13] = 'C';
+        store_le16(&out[14], 2);
+        store_le16(&out[16], bsize - 1);
+        uLong crc = crc32(0L, Z_NULL, 0);
+        if (len > 0)
+            crc = crc32(crc, reinterpret_cast<const Bytef*>(data), len);
+        store_le32(&out[bsize - 8], crc);
+        store_le32(&out[bsize - 4], len);
+        return true;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef _SFFSPLITTER_BGZF_HPP_
+#define _SFFSPLITTER_BGZF_HPP_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "pipeline.hpp"
+
+/* Uncompressed bytes per BGZF block, small enough for a block to stay
+ * under 64 KB even when its data does not compress */
+#define BGZF_BLOCK_SIZE 0xff00
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+
+namespace sff
+{
+    /* Pool of threads compressing data into BGZF blocks: gzip members
+     * of at most 64 KB, whose size is stored in a "BC" extra field. A
+     * BGZF file is a valid multi-member gzip file.
+     */
+    class BGZFCompressor
+    {
+        public:
+            BGZFCompressor(int level, int nthreads);
+            ~BGZFCompressor();
+            /* Compress the len bytes at data into consecutive blocks
+             * appended to out. Blocks are compressed in parallel by
+             * the pool, and compress returns once they all are. Safe
+             * to call from several threads */
+            bool compress(const char *data, size_t len,
+                          std::vector<char> &out);
+            /* Single block holding data uncompressed (at most
+             * BGZF_BLOCK_SIZE bytes). Its size only depends on len, so
+             * it can be rewritten in place with new contents */
+            static bool compress_stored(const char *data, size_t len,
+                                        std::vector<char> &out);
+            /* Empty block marking the end of a BGZF file */
+            static void eof_block(std::vector<char> &out);
+
+        private:
+            /* Blocks of one call to compress, still being compressed */
+            struct Batch
+            {
+                std::mutex mutex;
+                std::condition_variable done;
+                size_t pending;
+                bool ok;
+            };
+            struct Task
+            {
+                const char *data;
+                size_t len;
+                std::vector<char> *out;
+                Batch *batch;
+            };
+            void run();
+            static bool compress_block(const char *data, size_t len,
+                                       int level, std::vector<char> &out);
+            int level;
+            BoundedQueue<Task> tasks;
+            std::vector<std::thread> workers;
+    };
+}
+#endif
@@ -0,0 +1,104 @@
+#include <string.h>
+#include "bswap.hpp"
+#include "sff.hpp"
+
+#if (defined __x86_64__ || defined __i386__) && defined __GNUC__
+  #define SFF_X86_KERNELS
+  #include <immintrin.h>
+#endif
+
+namespace sff
+{
+    typedef void (*convert_be16_fn)(uint16_t*, const uint16_t*, size_t); 
+
+    static void convert_be16_scalar(uint16_t *dst, const uint16_t *src, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+            dst[i] = be16toh(src[i]); 
+    }
+
+#ifdef SFF_X86_KERNELS
+    /* Swap the two bytes of every 16-bit lane */
+    __attribute__((target("ssse3")))
+    static void convert_be16_ssse3(uint16_t *dst, const uint16_t *src, size_t n)
+    {
+        const __m128i shuffle = _mm_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 
+                                             6, 7, 4, 5, 2, 3, 0, 1); 
+        size_t i = 0; 
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i)); 
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i), 
+                             _mm_shuffle_epi8(v, shuffle)); 
+        }
+        convert_be16_scalar(dst+i, src+i, n-i); 
+    }
+
+    __attribute__((target("avx2")))
+    static void convert_be16_avx2(uint16_t *dst, const uint16_t *src, size_t n)
+    {
+        const __m256i shuffle = _mm256_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 
+                                                6, 7, 4, 5, 2, 3, 0, 1, 
+                                                14, 15, 12, 13, 10, 11, 8, 9, 
+                                                6, 7, 4, 5, 2, 3, 0, 1); 
+        size_t i = 0; 
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src+i)); 
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst+i), 
+                                _mm256_shuffle_epi8(v, shuffle)); 
+        }
+        convert_be16_ssse3(dst+i, src+i, n-i); 
+    }
+#endif
+
+    static bool host_is_big_endian()
+    {
+        return (htobe16(1) == 1); 
+    }
+
+    static void convert_be16_copy(uint16_t *dst, const uint16_t *src, size_t n)
+    {
+        if (dst != src)
+            memmove(dst, src, n*sizeof(uint16_t)); 
+    }
+
+    /* Pick the best kernel for this CPU */
+    static convert_be16_fn select_kernel(const char **name)
+    {
+        if (host_is_big_endian())
+        {
+            *name = "copy"; 
+            return convert_be16_copy; 
+        }
+#ifdef SFF_X86_KERNELS
+        __builtin_cpu_init(); 
+        if (__builtin_cpu_supports("avx2"))
+        {
+            *name = "avx2"; 
+            return convert_be16_avx2; 
+        }
+        if (__builtin_cpu_supports("ssse3"))
+        {
+            *name = "ssse3"; 
+            return convert_be16_ssse3; 
+        }
+#endif
+        *name = "scalar"; 
+        return convert_be16_scalar; 
+    }
+
+    static const char *kernel_name = NULL; 
+    /* Resolved during static initialization, before any thread runs */
+    static const convert_be16_fn kernel = select_kernel(&kernel_name); 
+
+    void convert_be16(uint16_t *dst, const uint16_t *src, size_t n)
+    {
+        kernel(dst, src, n); 
+    }
+
+    const char* convert_be16_kernel()
+    {
+        return kernel_name; 
+    }
+}
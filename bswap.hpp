@@ -0,0 +1,22 @@
+#ifndef _SFFSPLITTER_BSWAP_HPP_
+#define _SFFSPLITTER_BSWAP_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sff
+{
+    /* Convert n 16-bit values between big-endian and host order,
+     * from src to dst. The conversion is its own inverse, so it serves
+     * both directions, and src and dst may be the same buffer. Neither
+     * needs to be aligned.
+     * On x86 the kernel is chosen once at program start, by a static
+     * initializer: AVX2 or SSSE3 (pshufb) if the CPU supports it, and
+     * a scalar loop otherwise. On big-endian hosts this is a plain copy.
+     */
+    void convert_be16(uint16_t *dst, const uint16_t *src, size_t n); 
+
+    /* Name of the kernel convert_be16 dispatches to */
+    const char* convert_be16_kernel(); 
+}
+#endif
@@ -0,0 +1,266 @@
+#!/bin/sh
+# Behaviour checks of sff_splitter, run by 'make check' in the
+# directory given (emptied first):
+#  - outputs of -D, -p, -t, -F, -O, -x 0, -z, gzip (zero padded too)
+#    and standard input are byte for byte those of the default split
+#    of a generated input, with one end and with both (-r);
+#  - -U writes the same reads, -i and -l with several inputs the same
+#    files, and -G their concatenation;
+#  - -n copies the reads named, -e the adaptors of a -C container;
+#  - FASTQ, FASTA and QUAL hold the bases and qualities within the
+#    clips, and -s leaves out the adaptors -c clips;
+#  - reads made up to exercise ties, -m, -M hamming and -r go to the
+#    outputs expected.
+# Reads are compared as printed by sff_dump.
+set -e
+dir=${1:-check_data}
+
+fail()
+{
+    echo "check failed: $*"
+    exit 1
+}
+
+split()
+{
+    ./sff_splitter "$@" > /dev/null
+}
+
+# Split the input with the adaptors given, and byte-compare each output
+# directory to the first one: check_modes input adaptor_options modes...
+check_modes()
+{
+    input=$1
+    adaptors=$2
+    shift 2
+    reference=
+    for mode in "$@"; do
+        rm -rf $dir/mode && mkdir $dir/mode
+        split -i $input $adaptors -o $dir/mode/out $mode
+        if [ -z "$reference" ]; then
+            reference="$mode"
+            rm -rf $dir/reference && mv $dir/mode $dir/reference
+        else
+            diff -r $dir/reference $dir/mode > /dev/null ||
+                fail "$mode differs from $reference"
+        fi
+    done
+}
+
+# Reads within the clips, as sff_splitter -f writes them
+# (fastq, fasta or qual)
+trimmed()
+{
+    awk -F '\t' -v format=$1 '
+        BEGIN { for (i = 33; i < 127; i++) code[sprintf("%c", i)] = i - 33 }
+        {
+            n = length($2)
+            left = $4 > $6 ? $4 : $6
+            left = (left > 1 ? left : 1) - 1
+            right = ($5 == 0 || $5 > n) ? n : $5
+            if ($7 != 0 && $7 < right)
+                right = $7
+            len = right > left ? right - left : 0
+            bases = substr($2, left + 1, len)
+            quals = substr($3, left + 1, len)
+            if (format == "fastq")
+                printf "@%s\n%s\n+\n%s\n", $1, bases, quals
+            else if (format == "fasta")
+                printf ">%s\n%s\n", $1, bases
+            else
+            {
+                printf ">%s\n", $1
+                for (i = 1; i <= len; i++)
+                    printf "%s%d", (i > 1 ? " " : ""), code[substr(quals, i, 1)]
+                printf "\n"
+            }
+        }'
+}
+
+# Read name and output of every read split in the directory given
+assignments()
+{
+    for f in $1/out.*.sff; do
+        name=`basename $f .sff`
+        ./sff_dump $f | awk -v output=${name#out.} '{ print $1, output }'
+    done | sort
+}
+
+rm -rf $dir
+mkdir -p $dir
+
+# Generated inputs, with barcodes at one end and at both
+./sff_generate -o $dir/in.sff -a $dir/in.txt -B 24 -n 20000 -s 1
+./sff_generate -o $dir/in2.sff -a $dir/in.txt -n 5000 -s 2
+./sff_generate -o $dir/dual.sff -a $dir/left.txt -A $dir/right.txt \
+    -B 6 -n 5000 -s 3
+
+check_modes $dir/in.sff "-a $dir/in.txt" \
+    "" "-D" "-p" "-t 4" "-p -D -t 4" "-F" "-O 1" "-b 7"
+mv $dir/reference $dir/default
+check_modes $dir/in.sff "-a $dir/in.txt" "-m 2" "-m 2 -x 0" "-m 2 -p -t 4"
+check_modes $dir/dual.sff "-a $dir/left.txt -r $dir/right.txt" \
+    "-m 1" "-m 1 -x 0" "-m 1 -p -t 4" "-m 1 -D -O 2"
+
+# Compressed and standard input, compressed outputs
+gzip -c $dir/in.sff > $dir/in.sff.gz
+for input in $dir/in.sff.gz -; do
+    rm -rf $dir/mode && mkdir $dir/mode
+    split -i $input -a $dir/in.txt -o $dir/mode/out < $dir/in.sff.gz
+    diff -r $dir/default $dir/mode > /dev/null || fail "input $input"
+done
+split -i - -a $dir/in.txt -o $dir/mode/out < $dir/in.sff
+diff -r $dir/default $dir/mode > /dev/null || fail "standard input"
+# Zero bytes after the last gzip member, as tape or dd copies leave
+head -c 5000 /dev/zero | cat $dir/in.sff.gz - > $dir/padded.sff.gz
+rm -rf $dir/mode && mkdir $dir/mode
+split -i $dir/padded.sff.gz -a $dir/in.txt -o $dir/mode/out 2> $dir/stderr
+diff -r $dir/default $dir/mode > /dev/null || fail "zero padded gzip input"
+if grep -q "^Could not" $dir/stderr; then fail "zero padded gzip input"; fi
+rm -rf $dir/mode && mkdir $dir/mode
+split -i $dir/in.sff -a $dir/in.txt -o $dir/mode/out -z 6 -t 4
+for f in $dir/default/*.sff; do
+    gzip -dc $dir/mode/`basename $f`.gz | cmp -s - $f || fail "-z"
+done
+
+# Unordered batches: same reads, in any order
+rm -rf $dir/mode && mkdir $dir/mode
+split -i $dir/in.sff -a $dir/in.txt -o $dir/mode/out -U -t 4 -b 50
+[ "`ls $dir/default`" = "`ls $dir/mode`" ] || fail "-U outputs"
+for f in $dir/default/*.sff; do
+    ./sff_dump $f | sort > $dir/expected
+    ./sff_dump $dir/mode/`basename $f` | sort | cmp -s - $dir/expected ||
+        fail "-U reads"
+done
+
+# Several inputs: one set of outputs per input, or merged with -G
+mkdir $dir/single2 $dir/multi $dir/merged $dir/listed
+split -i $dir/in2.sff -a $dir/in.txt -o $dir/single2/out
+split -i $dir/in.sff -i $dir/in2.sff -a $dir/in.txt -o $dir/multi/out
+for f in $dir/default/*.sff; do
+    cmp -s $f $dir/multi/out.in.${f#$dir/default/out.} || fail "-i -i"
+done
+for f in $dir/single2/*.sff; do
+    cmp -s $f $dir/multi/out.in2.${f#$dir/single2/out.} || fail "-i -i"
+done
+split -i $dir/in.sff -i $dir/in2.sff -a $dir/in.txt -o $dir/merged/out -G
+printf "$dir/in.sff\n$dir/in2.sff\n" > $dir/inputs.txt
+split -l $dir/inputs.txt -a $dir/in.txt -o $dir/listed/out -G
+diff -r $dir/merged $dir/listed > /dev/null || fail "-l"
+for f in $dir/merged/*.sff; do
+    name=`basename $f`
+    for d in default single2; do
+        if [ -f $dir/$d/$name ]; then ./sff_dump $dir/$d/$name; fi
+    done > $dir/expected
+    ./sff_dump $f | cmp -s - $dir/expected || fail "-G $name"
+done
+
+# Lookup by name, in input order, skipping unknown names
+./sff_dump $dir/in.sff > $dir/in.dump
+awk 'NR % 97 == 5 { print $1 }' $dir/in.dump | sort -r > $dir/names.txt
+echo "NOT_A_READ" >> $dir/names.txt
+split -i $dir/in.sff -n $dir/names.txt -o $dir/named 2> /dev/null
+awk 'NR == FNR { wanted[$1] = 1; next } wanted[$1]' \
+    $dir/names.txt $dir/in.dump > $dir/expected
+./sff_dump $dir/named.sff | cmp -s - $dir/expected || fail "-n"
+
+# Adaptors copied out of a container
+split -i $dir/in.sff -a $dir/in.txt -o $dir/container -C
+for f in $dir/default/*.sff; do
+    name=`basename $f .sff`
+    name=${name#out.}
+    split -i $dir/container.sff -e $name -o $dir/extracted
+    cmp -s $dir/extracted.$name.sff $f || fail "-e $name"
+done
+
+# Text outputs, from the bases within the clips
+rm -rf $dir/mode && mkdir $dir/mode
+split -i $dir/in.sff -a $dir/in.txt -o $dir/mode/out -f fastq -t 4
+split -i $dir/in.sff -a $dir/in.txt -o $dir/mode/out -f fasta -F
+for f in $dir/default/*.sff; do
+    name=`basename $f .sff`
+    for format in fastq fasta qual; do
+        ./sff_dump $f | trimmed $format |
+            cmp -s - $dir/mode/$name.$format || fail "-f $format $name"
+    done
+done
+
+# -c clips the adaptors found, which -s leaves out of text outputs
+for input in in dual; do
+    if [ $input = in ]; then
+        adaptors="-a $dir/in.txt -m 2"
+    else
+        adaptors="-a $dir/left.txt -r $dir/right.txt -m 1"
+    fi
+    rm -rf $dir/clipped $dir/stripped && mkdir $dir/clipped $dir/stripped
+    split -i $dir/$input.sff $adaptors -o $dir/clipped/out -c
+    split -i $dir/$input.sff $adaptors -o $dir/stripped/out -f fastq -s
+    for f in $dir/clipped/*.sff; do
+        name=`basename $f .sff`
+        ./sff_dump $f | trimmed fastq |
+            cmp -s - $dir/stripped/$name.fastq || fail "-c -s $input $name"
+    done
+done
+
+# Known answers: A1 and A3 are one substitution apart, A4 is a prefix
+# of A5, reads are the barcode then an insert (then the right barcode).
+# Bases other than ACGTN (r09, r10) are mismatches, with the
+# neighborhood index as without (-x 0)
+printf "A1\tACGTACGTAC\nA2\tTGCATGCATG\nA3\tACGTTCGTAC\n" > $dir/known.txt
+printf "A4\tGGCCAAT\nA5\tGGCCAATTGG\n" >> $dir/known.txt
+printf "R1\tGATTACAGAT\nR2\tCCCGGGAAAT\n" > $dir/known_right.txt
+insert=GATCGATCCGATTGCAGCTAGGCTAACG
+# Read, barcode, then its output with -m 0, -m 1, -m 2, and -M hamming
+# with -m 1 and -m 2
+cat > $dir/known_answers.txt <<EOF
+r01 ACGTACGTAC A1 A1 A1 A1 A1
+r02 ACGTACCTAC unmatched A1 A1 A1 A1
+r03 AGTACGTAC unmatched A1 A1 unmatched unmatched
+r04 ACGTGCGTAC unmatched unmatched unmatched unmatched unmatched
+r05 TCCATGCAAG unmatched unmatched A2 unmatched A2
+r06 GGCCAATTGG A5 A5 A5 A5 A5
+r07 GGCCAATCCC A4 A4 A4 A4 A4
+r08 TTTTTTTTTT unmatched unmatched unmatched unmatched unmatched
+r09 TGCATRCATG unmatched A2 A2 A2 A2
+r10 TGCAtGCATG unmatched A2 A2 A2 A2
+EOF
+awk -v insert=$insert '{ print $1, $2, insert }' $dir/known_answers.txt \
+    > $dir/known_reads.txt
+./sff_generate -o $dir/known.sff -R $dir/known_reads.txt
+column=3
+for mode in "-m 0" "-m 1" "-m 2" "-M hamming -m 1" "-M hamming -m 2"; do
+    awk -v c=$column '{ print $1, $c }' $dir/known_answers.txt |
+        sort > $dir/expected
+    for cap in "" "-x 0"; do
+        rm -rf $dir/mode && mkdir $dir/mode
+        split -i $dir/known.sff -a $dir/known.txt -o $dir/mode/out $mode $cap
+        assignments $dir/mode | cmp -s - $dir/expected ||
+            fail "known answers, $mode $cap"
+    done
+    column=$((column + 1))
+done
+# Read, barcodes, then its output with -r and -m 0, and -m 1
+cat > $dir/known_answers.txt <<EOF
+p01 ACGTACGTAC GATTACAGAT A1+R1 A1+R1
+p02 TGCATGCATG CCCGGGAATT unmatched A2+R2
+p03 ACGTACGTAC TTTTTTTTTT unmatched unmatched
+p04 ACGTACCTAC GATTACAGAT unmatched A1+R1
+p05 ACGTGCGTAC GATTACAGAT unmatched unmatched
+p06 GGCCAATTGG CCCGGGAAAT A5+R2 A5+R2
+EOF
+awk -v insert=$insert '{ print $1, $2, insert, $3 }' $dir/known_answers.txt \
+    > $dir/known_reads.txt
+./sff_generate -o $dir/known.sff -R $dir/known_reads.txt
+column=4
+for mode in "-m 0" "-m 1" "-M hamming -m 1"; do
+    awk -v c=$column '{ print $1, $c }' $dir/known_answers.txt |
+        sort > $dir/expected
+    rm -rf $dir/mode && mkdir $dir/mode
+    split -i $dir/known.sff -a $dir/known.txt -r $dir/known_right.txt \
+        -o $dir/mode/out $mode
+    assignments $dir/mode | cmp -s - $dir/expected ||
+        fail "known answers, -r $mode"
+    column=5
+done
+
+echo "check passed"
@@ -0,0 +1,365 @@
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+  #include <zstd.h>
+#endif
+#include "instream.hpp"
+
+namespace sff
+{
+    InputCodec detect_codec(const char *data, size_t len)
+    {
+        const unsigned char *magic = 
+            reinterpret_cast<const unsigned char*>(data);
+        if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+            return INPUT_GZIP;
+        if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+            magic[2] == 0x2f && magic[3] == 0xfd)
+            return INPUT_ZSTD;
+        return INPUT_PLAIN;
+    }
+
+    bool is_plain_file(const std::string &filename)
+    {
+        if (filename == "-")
+            return false;
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        char magic[4];
+        bool plain = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+        if (plain)
+        {
+            ssize_t n = pread(fd, magic, sizeof(magic), 0);
+            plain = (n >= 0 && detect_codec(magic, n) == INPUT_PLAIN);
+        }
+        close(fd);
+        return plain;
+    }
+
+    InputStreamBuffer::InputStreamBuffer(const std::string &filename) :
+        fd(-1),
+        owns_fd(false),
+        full(INPUT_BLOCKS),
+        empty(INPUT_BLOCKS),
+        current(NULL),
+        consumed(0),
+        error(false)
+    {
+        if (filename == "-")
+            fd = STDIN_FILENO;
+        else
+        {
+            fd = open(filename.c_str(), O_RDONLY);
+            owns_fd = true;
+        }
+        if (fd < 0)
+            return;
+        for (int b = 0; b < INPUT_BLOCKS; b++)
+            empty.push(new std::vector<char>());
+        worker = std::thread(&InputStreamBuffer::run, this);
+    }
+
+    InputStreamBuffer::~InputStreamBuffer()
+    {
+        /* Unblocks the worker if the stream was not read to the end */
+        full.close();
+        empty.close();
+        if (worker.joinable())
+            worker.join();
+        std::vector<char> *block;
+        while (full.pop(block))
+            delete block;
+        while (empty.pop(block))
+            delete block;
+        delete current;
+        if (owns_fd && fd >= 0)
+            close(fd);
+    }
+
+    bool InputStreamBuffer::is_open() const
+    {
+        return (fd >= 0);
+    }
+
+    bool InputStreamBuffer::failed() const
+    {
+        return error;
+    }
+
+    InputStreamBuffer::int_type InputStreamBuffer::underflow()
+    {
+        if (current != NULL)
+        {
+            /* Done with this block, hand it back to the worker */
+            consumed += current->size();
+            setg(NULL, NULL, NULL);
+            empty.push(current);
+            current = NULL;
+        }
+        while (full.pop(current))
+        {
+            if (!current->empty())
+            {
+                char *data = &(*current)[0];
+                setg(data, data, data + current->size());
+                return traits_type::to_int_type(*gptr());
+            }
+            empty.push(current);
+        }
+        current = NULL;
+        return traits_type::eof();
+    }
+
+    InputStreamBuffer::pos_type InputStreamBuffer::seekoff(
+            off_type off, std::ios_base::seekdir dir,
+            std::ios_base::openmode which)
+    {
+        /* Only telling the current position is supported */
+        if (off != 0 || dir != std::ios_base::cur ||
+            !(which & std::ios_base::in))
+            return pos_type(off_type(-1));
+        return pos_type(consumed + (gptr() - eback()));
+    }
+
+    bool InputStreamBuffer::read_block(std::vector<char> &block)
+    {
+        /* Fill the whole block, a pipe returns at most what the
+         * writer has written so far */
+        block.resize(INPUT_BLOCK_SIZE);
+        size_t got = 0;
+        while (got < block.size())
+        {
+            ssize_t n = read(fd, &block[got], block.size() - got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                std::cerr << "Could not read input: "
+                          << strerror(errno) << std::endl;
+                block.clear();
+                return false;
+            }
+            if (n == 0)
+                break;
+            got += n;
+        }
+        block.resize(got);
+        return true;
+    }
+
+    bool InputStreamBuffer::emit(std::vector<char> *&out, size_t len)
+    {
+        /* Pass len decoded bytes to the parser and get a free block */
+        out->resize(len);
+        if (!full.push(out))
+            return false;
+        out = NULL;
+        if (!empty.pop(out))
+            return false;
+        out->resize(INPUT_BLOCK_SIZE);
+        return true;
+    }
+
+    void InputStreamBuffer::run()
+    {
+        std::vector<char> *out = NULL;
+        if (!empty.pop(out))
+            return;
+        bool ok = read_block(*out);
+        /* The format is told by its first bytes, so it does not
+         * depend on the file name and works on standard input */
+        InputCodec codec = detect_codec(out->data(), out->size());
+
+        if (ok && codec == INPUT_PLAIN)
+            ok = decode_plain(out);
+        else if (ok)
+        {
+            /* Compressed bytes go through their own buffer */
+            std::vector<char> in;
+            in.swap(*out);
+            out->resize(INPUT_BLOCK_SIZE);
+            if (codec == INPUT_GZIP)
+                ok = decode_gzip(in, out);
+            else
+                ok = decode_zstd(in, out);
+        }
+        if (!ok)
+            error = true;
+        /* out is NULL, or not queued anywhere once the queues were 
+         * closed under us */
+        if (out != NULL && !empty.push(out))
+            delete out;
+        full.close();
+    }
+
+    bool InputStreamBuffer::decode_plain(std::vector<char> *&out)
+    {
+        while (!out->empty())
+        {
+            if (!emit(out, out->size()))
+                return true;
+            if (!read_block(*out))
+                return false;
+        }
+        return true;
+    }
+
+    bool InputStreamBuffer::decode_gzip(std::vector<char> &in,
+                                        std::vector<char> *&out)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        /* Accept gzip and zlib headers */
+        if (inflateInit2(&zs, 15 + 32) != Z_OK)
+            return false;
+        bool ok = true;
+        bool at_end = false;  // Whether the last member was complete
+        bool padded = false;  // Whether zero bytes followed it
+        size_t have = 0;
+        while (ok && !in.empty())
+        {
+            zs.next_in = reinterpret_cast<Bytef*>(&in[0]);
+            zs.avail_in = in.size();
+            /* Keep going while there is input, or output left behind
+             * when the block was filled */
+            bool filled = false;
+            while (ok && (zs.avail_in > 0 || filled))
+            {
+                /* Zero bytes after a complete member, from tape or dd
+                 * copies, end the input as they do for gzip */
+                if (at_end && zs.avail_in > 0 && *zs.next_in == 0)
+                    padded = true;
+                if (padded)
+                {
+                    while (zs.avail_in > 0 && *zs.next_in == 0)
+                    {
+                        zs.next_in++;
+                        zs.avail_in--;
+                    }
+                    if (zs.avail_in > 0)
+                    {
+                        std::cerr << "Could not decompress gzip input" << std::endl;
+                        ok = false;
+                    }
+                    filled = false;
+                    continue;
+                }
+                zs.next_out = reinterpret_cast<Bytef*>(&(*out)[have]);
+                zs.avail_out = INPUT_BLOCK_SIZE - have;
+                int ret = inflate(&zs, Z_NO_FLUSH);
+                have = INPUT_BLOCK_SIZE - zs.avail_out;
+                if (ret == Z_STREAM_END)
+                {
+                    /* Multi-member files (pigz, bgzip) carry on with
+                     * a new member */
+                    at_end = true;
+                    inflateReset(&zs);
+                }
+                else if (ret == Z_OK)
+                    at_end = false;
+                else if (ret == Z_BUF_ERROR)
+                    break;
+                else
+                {
+                    std::cerr << "Could not decompress gzip input" << std::endl;
+                    ok = false;
+                }
+                filled = (have == INPUT_BLOCK_SIZE);
+                if (filled)
+                {
+                    if (!emit(out, have))
+                    {
+                        inflateEnd(&zs);
+                        return true;
+                    }
+                    have = 0;
+                }
+            }
+            if (ok)
+                ok = read_block(in);
+        }
+        inflateEnd(&zs);
+        if (ok && !at_end)
+        {
+            std::cerr << "Truncated gzip input" << std::endl;
+            ok = false;
+        }
+        if (ok && padded)
+            std::cerr << "Trailing zero bytes after gzip input ignored" << std::endl;
+        if (have > 0)
+            emit(out, have);
+        return ok;
+    }
+
+    bool InputStreamBuffer::decode_zstd(std::vector<char> &in,
+                                        std::vector<char> *&out)
+    {
+#ifdef HAVE_ZSTD
+        ZSTD_DStream *ds = ZSTD_createDStream();
+        if (ds == NULL)
+            return false;
+        ZSTD_initDStream(ds);
+        bool ok = true;
+        bool at_end = false;  // Whether the last frame was complete
+        size_t have = 0;
+        while (ok && !in.empty())
+        {
+            ZSTD_inBuffer ib = {in.data(), in.size(), 0};
+            /* Keep going while there is input, or output left behind
+             * when the block was filled */
+            bool filled = false;
+            while (ok && (ib.pos < ib.size || filled))
+            {
+                ZSTD_outBuffer ob = {&(*out)[0], INPUT_BLOCK_SIZE, have};
+                size_t ret = ZSTD_decompressStream(ds, &ob, &ib);
+                if (ZSTD_isError(ret))
+                {
+                    std::cerr << "Could not decompress zstd input: "
+                              << ZSTD_getErrorName(ret) << std::endl;
+                    ok = false;
+                    break;
+                }
+                if (ob.pos == have && ib.pos == ib.size)
+                    break;
+                have = ob.pos;
+                /* 0 once a frame is fully decoded and flushed */
+                at_end = (ret == 0);
+                filled = (have == INPUT_BLOCK_SIZE);
+                if (filled)
+                {
+                    if (!emit(out, have))
+                    {
+                        ZSTD_freeDStream(ds);
+                        return true;
+                    }
+                    have = 0;
+                }
+            }
+            if (ok)
+                ok = read_block(in);
+        }
+        ZSTD_freeDStream(ds);
+        if (ok && !at_end)
+        {
+            std::cerr << "Truncated zstd input" << std::endl;
+            ok = false;
+        }
+        if (have > 0)
+            emit(out, have);
+        return ok;
+#else
+        (void)in;
+        (void)out;
+        std::cerr << "zstd input is not supported by this build, "
+                  << "rebuild with 'make ZSTD=1'" << std::endl;
+        return false;
+#endif
+    }
+}
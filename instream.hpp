@@ -0,0 +1,78 @@
+#ifndef _SFFSPLITTER_INSTREAM_HPP_
+#define _SFFSPLITTER_INSTREAM_HPP_
+
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "pipeline.hpp"
+
+/* Size of the blocks handed from the input thread to the parser */
+#define INPUT_BLOCK_SIZE (1024*1024)
+/* Number of blocks in flight between the input thread and the parser */
+#define INPUT_BLOCKS 8
+
+namespace sff
+{
+    /* Compression of an input, found from its first bytes */
+    enum InputCodec
+    {
+        INPUT_PLAIN,
+        INPUT_GZIP,
+        INPUT_ZSTD
+    };
+
+    /* Codec of an input starting with the len bytes at data */
+    InputCodec detect_codec(const char *data, size_t len);
+    /* Whether filename is an uncompressed regular file, that can be
+     * read directly rather than through an InputStreamBuffer */
+    bool is_plain_file(const std::string &filename);
+
+    /* Stream buffer over a file, standard input ("-") or a FIFO,
+     * read and decompressed (gzip, or zstd when built with HAVE_ZSTD)
+     * on a background thread. Decoded blocks reach the parser through
+     * a ring of INPUT_BLOCKS recycled buffers, so decompression
+     * overlaps with whatever consumes the stream. The input is never
+     * seeked: the only position that can be asked for (tellg) is the
+     * number of decoded bytes consumed so far.
+     */
+    class InputStreamBuffer : public std::streambuf
+    {
+        public:
+            InputStreamBuffer(const std::string &filename);
+            /* Stops the background thread, even if the stream was not
+             * read to the end */
+            ~InputStreamBuffer();
+            /* Whether the input could be opened */
+            bool is_open() const;
+            /* Whether reading or decompressing the input failed. The
+             * stream then ends early */
+            bool failed() const;
+
+        protected:
+            int_type underflow();
+            pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                             std::ios_base::openmode which);
+
+        private:
+            void run();
+            bool read_block(std::vector<char> &block);
+            /* Decode the input, in holding its first block, into
+             * blocks emitted one at a time through out */
+            bool decode_plain(std::vector<char> *&out);
+            bool decode_gzip(std::vector<char> &in, std::vector<char> *&out);
+            bool decode_zstd(std::vector<char> &in, std::vector<char> *&out);
+            bool emit(std::vector<char> *&out, size_t len);
+            int fd;
+            bool owns_fd;
+            /* Blocks holding decoded bytes, and blocks free to reuse */
+            BoundedQueue<std::vector<char>*> full;
+            BoundedQueue<std::vector<char>*> empty;
+            std::vector<char> *current;  // Block being parsed
+            uint64_t consumed;   // Bytes in the blocks before current
+            std::atomic<bool> error;
+            std::thread worker;
+    };
+}
+#endif
@@ -0,0 +1,72 @@
+#ifndef _SFFSPLITTER_PIPELINE_HPP_
+#define _SFFSPLITTER_PIPELINE_HPP_
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+namespace sff
+{
+    /* Fixed capacity FIFO connecting two pipeline stages. Producers
+     * block while the queue is full, so a fast stage cannot run
+     * arbitrarily far ahead of a slow one (backpressure). Consumers
+     * block while it is empty. Once closed, push fails and pop
+     * drains the remaining items before failing.
+     */
+    template <typename T>
+    class BoundedQueue
+    {
+        public:
+            BoundedQueue(size_t capacity) :
+                capacity(capacity > 0 ? capacity : 1),
+                closed(false)
+            {}
+
+            /* Blocks until there is room. Returns false if the
+             * queue was closed */
+            bool push(const T &item)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (items.size() >= capacity && !closed)
+                    not_full.wait(lock);
+                if (closed)
+                    return false;
+                items.push_back(item);
+                not_empty.notify_one();
+                return true;
+            }
+
+            /* Blocks until an item is available. Returns false once
+             * the queue is closed and empty */
+            bool pop(T &item)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (items.empty() && !closed)
+                    not_empty.wait(lock);
+                if (items.empty())
+                    return false;
+                item = items.front();
+                items.pop_front();
+                not_full.notify_one();
+                return true;
+            }
+
+            /* No more items will be pushed. Wakes up every waiter */
+            void close()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                not_empty.notify_all();
+                not_full.notify_all();
+            }
+
+        private:
+            std::deque<T> items;
+            size_t capacity;
+            bool closed;
+            std::mutex mutex;
+            std::condition_variable not_empty;
+            std::condition_variable not_full;
+    };
+}
+#endif
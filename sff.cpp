@@ -3,7 +3,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <algorithm>
+#include <iterator>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <errno.h>
 #include "sff.hpp"
+#include "stats.hpp"
+#include "bswap.hpp"
 
 namespace sff
 {
@@ -132,6 +142,14 @@ namespace sff
         quality(nbases)
     {}
 
+    void SFFReadData::resize(uint16_t flow_len, uint32_t nbases)
+    {
+        flowgram.resize(flow_len); 
+        flow_index.resize(nbases); 
+        bases.resize(nbases); 
+        quality.resize(nbases); 
+    }
+
     int SFFReadData::get_size() const
     {
         int flow_len = flowgram.size();
@@ -145,28 +163,25 @@ namespace sff
 
     void SFFReadData::host_to_big_endian()
     {
-        int flow_len = flowgram.size(); 
-        int i;
-        for (i = 0; i < flow_len; i++) {
-            flowgram[i] = htobe16(flowgram[i]);
-        }
+        convert_be16(&flowgram[0], &flowgram[0], flowgram.size()); 
     }
 
     void SFFReadData::big_endian_to_host()
     {
-        int flow_len = flowgram.size(); 
-        int i;
-        for (i = 0; i < flow_len; i++) {
-            flowgram[i] = be16toh(flowgram[i]);
-        }
+        convert_be16(&flowgram[0], &flowgram[0], flowgram.size()); 
     }
 
     /*** Begin SFFRead implementation ***/
     SFFField::SFFField(const SFFFileHeader &header) :
         key_len(header.key_len), 
         flow_len(header.flow_len),
-        key(header.key)
-    {}
+        key(&header.key),
+        header(NULL),
+        data(NULL),
+        viewed(false)
+    {
+        memset(&view, 0, sizeof(view)); 
+    }
 
     SFFField::~SFFField()
     {
@@ -176,6 +191,16 @@ namespace sff
 
     bool SFFField::validate() const
     {
+        if (viewed)
+        {
+            if (view.nbases < key_len || 
+                !std::equal(view.bases, view.bases + key_len, key->begin()))
+            {
+                std::cerr << "Field does not start with expected key" << std::endl;
+                return false;
+            }
+            return true;
+        }
         if (flow_len != data->flowgram.size())
         {
             std::cerr << "Error reading field flowgram" << std::endl;
@@ -187,7 +212,7 @@ namespace sff
             return false;
         }
         if (!std::equal(data->bases.begin(), 
-                       data->bases.begin() + key_len, key.begin()))
+                       data->bases.begin() + key_len, key->begin()))
         {
             std::cerr << "Field does not start with expected key" << std::endl;
             return false;
@@ -207,7 +232,7 @@ namespace sff
 
     std::string SFFField::get_name() const
     {
-        return header->name;
+        return std::string(view.name, view.name_len);
     }
 
     int SFFField::get_flow_len() const
@@ -220,26 +245,122 @@ namespace sff
         return key_len;
     }
 
-    std::vector<char> SFFField::get_key() const
+    const std::vector<char>& SFFField::get_key() const
     {
-        return key;
+        return *key;
     }
 
-    void SFFField::set_header(const SFFReadHeader *h)
+    void SFFField::set_header(SFFReadHeader *h)
     {
+        if (header != h)
+            delete header; 
         header = h; 
+        viewed = false;
+        view.header_len         = h->header_len; 
+        view.name_len           = h->name_len; 
+        view.nbases             = h->nbases; 
+        view.clip_qual_left     = h->clip_qual_left; 
+        view.clip_qual_right    = h->clip_qual_right; 
+        view.clip_adapter_left  = h->clip_adapter_left; 
+        view.clip_adapter_right = h->clip_adapter_right; 
+        view.name               = h->name.data(); 
+        view.record             = NULL;
+        view.record_len         = 0;
     }
 
-    void SFFField::set_data(const SFFReadData *d)
+    void SFFField::set_data(SFFReadData *d)
     {
+        if (data != d)
+            delete data; 
         data = d;
+        view.flowgram   = NULL; 
+        view.flow_index = d->flow_index.data(); 
+        view.bases      = d->bases.data(); 
+        view.quality    = d->quality.data(); 
+    }
+
+    void SFFField::set_view(const SFFReadView &v)
+    {
+        view = v; 
+        viewed = true; 
+    }
+
+    void SFFField::set_common_header(const SFFFileHeader &h)
+    {
+        key_len = h.key_len; 
+        flow_len = h.flow_len; 
+        key = &h.key; 
+    }
+
+    SFFReadHeader* SFFField::get_header_storage()
+    {
+        if (header == NULL)
+            header = new SFFReadHeader(); 
+        return header; 
+    }
+
+    SFFReadData* SFFField::get_data_storage()
+    {
+        if (data == NULL)
+            data = new SFFReadData(flow_len, 0); 
+        return data; 
+    }
+
+    std::vector<char>& SFFField::get_record_storage()
+    {
+        return record; 
+    }
+
+    const SFFReadView& SFFField::get_view() const
+    {
+        return view; 
+    }
+
+    bool SFFField::is_view() const
+    {
+        return viewed; 
+    }
+
+    void SFFField::decode_view()
+    {
+        SFFReadHeader *h = get_header_storage(); 
+        h->header_len         = view.header_len; 
+        h->name_len           = view.name_len; 
+        h->nbases             = view.nbases; 
+        h->clip_qual_left     = view.clip_qual_left; 
+        h->clip_qual_right    = view.clip_qual_right; 
+        h->clip_adapter_left  = view.clip_adapter_left; 
+        h->clip_adapter_right = view.clip_adapter_right; 
+        h->name.assign(view.name, view.name_len); 
+
+        SFFReadData *d = get_data_storage(); 
+        d->resize(flow_len, view.nbases); 
+        convert_be16(&d->flowgram[0], view.flowgram, flow_len); 
+        std::copy(view.flow_index, view.flow_index + view.nbases, 
+                  d->flow_index.begin()); 
+        std::copy(view.bases, view.bases + view.nbases, d->bases.begin()); 
+        std::copy(view.quality, view.quality + view.nbases, 
+                  d->quality.begin()); 
+        set_header(h); 
+        set_data(d); 
+    }
+
+    void SFFField::set_adaptor_clips(uint16_t left, uint16_t right)
+    {
+        view.clip_adapter_left = left; 
+        view.clip_adapter_right = right; 
+        if (!viewed)
+        {
+            header->clip_adapter_left = left; 
+            header->clip_adapter_right = right; 
+        }
     }
 
     int SFFField::get_left_clip_value() const
     {
         int left_clip = std::max(
-               1, (int)std::max(header->clip_qual_left, 
-                                header->clip_adapter_left));
+               1, (int)std::max(view.clip_qual_left, 
+                                view.clip_adapter_left));
 
         /* account for the 1-based index value */
         left_clip = left_clip - 1;
@@ -249,46 +370,352 @@ namespace sff
     int SFFField::get_right_clip_value() const
     {
         int right_clip = (int) std::min(
-              (header->clip_qual_right == 0 ? header->nbases : header->clip_qual_right),
-              (header->clip_adapter_right == 0 ? header->nbases : header->clip_adapter_right)
+              (view.clip_qual_right == 0 ? view.nbases : view.clip_qual_right),
+              (view.clip_adapter_right == 0 ? view.nbases : view.clip_adapter_right)
         );
         return right_clip;
     }
 
     std::string SFFField::get_left_adaptor_sequence(int size) const
+    {
+        const char *bases; 
+        int len = get_left_adaptor_bases(size, &bases); 
+        std::string retval(bases, bases+len); 
+        return retval;
+    }
+
+    int SFFField::get_left_adaptor_bases(int size, const char **bases) const
     {
         int left_clip = get_left_clip_value(); 
         /* Don't run over */
         int left_pos = std::min(left_clip, size+key_len);
-        std::string retval(data->bases.begin()+key_len, 
-                           data->bases.begin()+left_pos); 
-        return retval;
+        /* Nor past the last base, whatever the clip says */
+        left_pos = std::min(left_pos, (int)view.nbases); 
+        *bases = view.bases + key_len; 
+        /* A left clip falling inside the key leaves no adaptor bases */
+        return std::max(0, left_pos - key_len);
+    }
+
+    std::string SFFField::get_right_adaptor_sequence(int size) const
+    {
+        const char *bases; 
+        int len = get_right_adaptor_bases(size, &bases); 
+        return std::string(bases, bases+len); 
+    }
+
+    int SFFField::get_right_adaptor_bases(int size, const char **bases) const
+    {
+        int nbases = view.nbases; 
+        int right_clip = std::min(get_right_clip_value(), nbases); 
+        /* Keep clear of the key and the left adaptor */
+        int right_pos = std::max(nbases - size, 
+                                 std::max((int)key_len, get_left_clip_value())); 
+        if (right_clip < nbases)
+            right_pos = std::max(right_pos, right_clip); 
+        right_pos = std::min(right_pos, nbases); 
+        *bases = view.bases + right_pos; 
+        return nbases - right_pos; 
+    }
+
+    /* Big-endian loads and stores on raw records. memcpy keeps them 
+     * safe on unaligned offsets and compiles down to a plain move */
+    static inline uint16_t load_be16(const char *p)
+    {
+        uint16_t v; 
+        memcpy(&v, p, sizeof(v)); 
+        return be16toh(v); 
+    }
+
+    static inline uint32_t load_be32(const char *p)
+    {
+        uint32_t v; 
+        memcpy(&v, p, sizeof(v)); 
+        return be32toh(v); 
+    }
+
+    static inline uint64_t load_be64(const char *p)
+    {
+        uint64_t v; 
+        memcpy(&v, p, sizeof(v)); 
+        return be64toh(v); 
+    }
+
+    static inline void store_be16(char *p, uint16_t v)
+    {
+        v = htobe16(v); 
+        memcpy(p, &v, sizeof(v)); 
+    }
+
+    static inline void store_be32(char *p, uint32_t v)
+    {
+        v = htobe32(v); 
+        memcpy(p, &v, sizeof(v)); 
+    }
+
+    static inline void store_be64(char *p, uint64_t v)
+    {
+        v = htobe64(v); 
+        memcpy(p, &v, sizeof(v)); 
+    }
+
+    /* Round size up to the next multiple of PADDING_SIZE */
+    static inline uint64_t padded_size(uint64_t size)
+    {
+        return (size + PADDING_SIZE - 1) / PADDING_SIZE * PADDING_SIZE; 
+    }
+
+    /* Fixed part of a read header: header_len, name_len, nbases and
+     * the four clip values */
+    #define READ_HEADER_FIXED_SIZE 16
+
+    /* Size of the read starting at record, padding included. Only the
+     * fixed part of its header is looked at */
+    static inline uint64_t record_size(const char *record, uint16_t flow_len)
+    {
+        uint16_t name_len = load_be16(record+2); 
+        uint32_t nbases = load_be32(record+4); 
+        /* Both sections are padded to a multiple of 8-bytes */
+        return padded_size(READ_HEADER_FIXED_SIZE + name_len) + 
+               padded_size(sizeof(uint16_t)*flow_len + 3*(uint64_t)nbases); 
+    }
+
+    /* Same, without the padding of the data section, which a last read
+     * may be missing */
+    static inline uint64_t unpadded_record_size(const char *record, 
+                                                uint16_t flow_len)
+    {
+        uint16_t name_len = load_be16(record+2); 
+        uint32_t nbases = load_be32(record+4); 
+        return padded_size(READ_HEADER_FIXED_SIZE + name_len) + 
+               sizeof(uint16_t)*flow_len + 3*(uint64_t)nbases; 
+    }
+
+    /* Point view at the read starting at record, which must hold the
+     * record_size() bytes of the read */
+    static void parse_record(const char *record, uint16_t flow_len, 
+                             SFFReadView &view)
+    {
+        view.header_len         = load_be16(record); 
+        view.name_len           = load_be16(record+2); 
+        view.nbases             = load_be32(record+4); 
+        view.clip_qual_left     = load_be16(record+8); 
+        view.clip_qual_right    = load_be16(record+10); 
+        view.clip_adapter_left  = load_be16(record+12); 
+        view.clip_adapter_right = load_be16(record+14); 
+        view.name               = record + READ_HEADER_FIXED_SIZE; 
+
+        const char *data = record + 
+                padded_size(READ_HEADER_FIXED_SIZE + view.name_len); 
+        view.flowgram   = reinterpret_cast<const uint16_t*>(data); 
+        view.flow_index = reinterpret_cast<const uint8_t*>(
+                                data + sizeof(uint16_t)*flow_len); 
+        view.bases      = reinterpret_cast<const char*>(
+                                view.flow_index + view.nbases); 
+        view.quality    = reinterpret_cast<const uint8_t*>(
+                                view.bases + view.nbases); 
+        view.record     = record; 
+        view.record_len = record_size(record, flow_len); 
+    }
+
+    /*** Begin SFFReadIndex implementation ***/
+    /* Max offset the base 255 digits of a Roche index can hold */
+    #define SRT_MAX_OFFSET (255ULL*255*255*255 - 1)
+
+    void SFFReadIndex::add(const char *name, uint16_t name_len, 
+                           uint64_t offset)
+    {
+        Entry entry = {offset, names.size(), name_len}; 
+        names.insert(names.end(), name, name + name_len); 
+        entries.push_back(entry); 
+    }
+
+    void SFFReadIndex::sort()
+    {
+        const char *n = names.data(); 
+        auto less = [n](const Entry &a, const Entry &b) {
+            int c = memcmp(n + a.name_pos, n + b.name_pos, 
+                           std::min(a.name_len, b.name_len)); 
+            return c < 0 || (c == 0 && a.name_len < b.name_len); 
+        }; 
+        if (!std::is_sorted(entries.begin(), entries.end(), less))
+            std::sort(entries.begin(), entries.end(), less); 
+    }
+
+    bool SFFReadIndex::find(const std::string &name, uint64_t &offset) const
+    {
+        /* Binary search for the first entry not before name */
+        const char *n = names.data(); 
+        size_t lo = 0, hi = entries.size(); 
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2; 
+            const Entry &e = entries[mid]; 
+            int c = memcmp(n + e.name_pos, name.data(), 
+                           std::min((size_t)e.name_len, name.size())); 
+            if (c < 0 || (c == 0 && e.name_len < name.size()))
+                lo = mid + 1; 
+            else
+                hi = mid; 
+        }
+        if (lo == entries.size() || entries[lo].name_len != name.size() || 
+            memcmp(n + entries[lo].name_pos, name.data(), name.size()) != 0)
+            return false; 
+        offset = entries[lo].offset; 
+        return true; 
+    }
+
+    size_t SFFReadIndex::size() const
+    {
+        return entries.size(); 
+    }
+
+    uint64_t SFFReadIndex::get_max_offset() const
+    {
+        uint64_t max_offset = 0; 
+        for (size_t i = 0; i < entries.size(); i++)
+            max_offset = std::max(max_offset, entries[i].offset); 
+        return max_offset; 
+    }
+
+    bool SFFReadIndex::decode_roche(const char *in, uint64_t len)
+    {
+        uint64_t p; 
+        if (len >= SFF_INDEX_HEADER_SIZE && 
+            memcmp(in, SFF_INDEX_SRT, 8) == 0)
+            p = SFF_INDEX_HEADER_SIZE; 
+        else if (len >= SFF_INDEX_MFT_HEADER_SIZE && 
+                 memcmp(in, SFF_INDEX_MFT, 8) == 0)
+            /* Skip the XML manifest */
+            p = SFF_INDEX_MFT_HEADER_SIZE + load_be32(in + 8); 
+        else
+            return false; 
+        /* Stop at the end, or at padding counted in len */
+        while (p < len && in[p] != 0)
+        {
+            /* Name, a null byte, 4 base 255 digits and 0xff. Digits 
+             * are never 0xff, so the first 0xff past the name ends it */
+            if (len < p + 6)
+                return false; 
+            const char *end = static_cast<const char*>(
+                    memchr(in + p + 5, 0xff, len - p - 5)); 
+            if (end == NULL || end[-5] != 0)
+                return false; 
+            const uint8_t *d = reinterpret_cast<const uint8_t*>(end - 4); 
+            uint64_t offset = ((d[0]*255ULL + d[1])*255 + d[2])*255 + d[3]; 
+            add(in + p, end - 5 - (in + p), offset); 
+            p = end - in + 1; 
+        }
+        return true; 
+    }
+
+    void SFFReadIndex::encode_roche(std::vector<char> &out) const
+    {
+        out.assign(SFF_INDEX_SRT, SFF_INDEX_SRT + 8); 
+        out.resize(SFF_INDEX_HEADER_SIZE, 0); 
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            /* Each entry is the name, a null byte, the offset of the 
+             * read as 4 base 255 digits, most significant first, and 
+             * a 0xff terminator */
+            const Entry &e = entries[i]; 
+            out.insert(out.end(), names.begin() + e.name_pos, 
+                       names.begin() + e.name_pos + e.name_len); 
+            out.push_back(0); 
+            out.push_back((char)(e.offset / (255*255*255))); 
+            out.push_back((char)(e.offset / (255*255) % 255)); 
+            out.push_back((char)(e.offset / 255 % 255)); 
+            out.push_back((char)(e.offset % 255)); 
+            out.push_back((char)0xff); 
+        }
+    }
+
+    bool SFFReadIndex::decode_sidecar(const char *in, uint64_t len)
+    {
+        uint64_t p = 0; 
+        while (p < len)
+        {
+            if (len < p + 2)
+                return false; 
+            uint16_t name_len = load_be16(in + p); 
+            if (len < p + 2 + name_len + 8)
+                return false; 
+            add(in + p + 2, name_len, load_be64(in + p + 2 + name_len)); 
+            p += 2 + name_len + 8; 
+        }
+        return true; 
+    }
+
+    void SFFReadIndex::encode_sidecar(std::vector<char> &out) const
+    {
+        out.clear(); 
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            const Entry &e = entries[i]; 
+            char len[2], offset[8]; 
+            store_be16(len, e.name_len); 
+            store_be64(offset, e.offset); 
+            out.insert(out.end(), len, len + 2); 
+            out.insert(out.end(), names.begin() + e.name_pos, 
+                       names.begin() + e.name_pos + e.name_len); 
+            out.insert(out.end(), offset, offset + 8); 
+        }
     }
 
     /*** Begin SFFFileReader implementation ***/
-    SFFFileReader::SFFFileReader(const std::string &filename) :
-        ifs(filename.c_str(), std::ifstream::binary)
+    SFFFileReader::SFFFileReader(const std::string &filename, bool raw) :
+        stream(NULL),
+        ifs(NULL),
+        raw(raw),
+        flow_len(0),
+        index_offset(0),
+        consumed(0)
     {
-        if (!ifs.is_open())
+        if (is_plain_file(filename))
+        {
+            if (file.open(filename.c_str(), 
+                          std::ios::in | std::ios::binary) == NULL)
+                throw std::runtime_error("Could not open file for reading");
+            ifs.rdbuf(&file); 
+            return; 
+        }
+        stream = new InputStreamBuffer(filename); 
+        if (!stream->is_open())
+        {
+            delete stream; 
             throw std::runtime_error("Could not open file for reading");
+        }
+        ifs.rdbuf(stream); 
     }
 
     SFFFileReader::~SFFFileReader()
     {
-        ifs.close();
+        ifs.rdbuf(NULL); 
+        delete stream; 
     }
 
     bool SFFFileReader::done()
     {
-        /* Check that we are at end of file */
+        /* Check that we are at end of file, or of reads */
         char c = ifs.peek(); 
-        return (c == EOF); 
+        if (c == EOF)
+            return true; 
+        return (index_offset > 0 && consumed >= index_offset); 
+    }
+
+    uint64_t SFFFileReader::get_bytes_read()
+    {
+        /* Asked to the buffer directly, tellg fails once the stream
+         * reached its end */
+        std::streampos at = ifs.rdbuf()->pubseekoff(0, std::ios::cur, 
+                                                    std::ios::in); 
+        return (at < 0) ? 0 : (uint64_t)at; 
     }
 
     bool SFFFileReader::good()
     {
         /* Check that the file stream is in good state for reading */
-        bool good = (ifs && !ifs.eof()); 
+        bool good = (ifs && !ifs.eof() && 
+                     (stream == NULL || !stream->failed())); 
         return good; 
     }
 
@@ -328,6 +755,7 @@ namespace sff
         /* Now we read the flow and the key */
         header.key = std::vector<char>(header.key_len); 
         header.flow = std::vector<char>(header.flow_len); 
+        flow_len = header.flow_len; 
         ifs.read(reinterpret_cast<char*>(&header.flow[0]), 
                  sizeof(header.flow[0])*header.flow_len); 
         if (!good()) return false;
@@ -342,6 +770,12 @@ namespace sff
         if ( !(header_size % PADDING_SIZE == 0) ) {
             readPadding = read_padding(header_size);
         }
+        /* Reads run up to the index when it follows them. Bytes read
+         * are counted rather than asked to the stream, which would 
+         * seek the file once per read */
+        consumed = padded_size(header_size); 
+        if (header.index_len > 0 && header.index_offset >= consumed)
+            index_offset = header.index_offset; 
         return (header.validate() && readPadding);
     }
 
@@ -372,11 +806,10 @@ namespace sff
         /* sff files are in big endian notation so adjust appropriately */
         header->host_to_big_endian(); 
 
-        /* finally appropriately allocate and read the read_name string */
-        char name[header->name_len];
-        ifs.read(name, sizeof(char)*(header->name_len));
+        /* finally read the read_name string, reusing its capacity */
+        header->name.resize(header->name_len); 
+        ifs.read(&header->name[0], sizeof(char)*(header->name_len));
         if (!good()) return false;
-        header->name = std::string(name, name+(header->name_len));
 
         /* the section should be a multiple of 8-bytes, if not,
            it is zero-byte padded to make it so */
@@ -420,19 +853,58 @@ namespace sff
 
     bool SFFFileReader::read_field(SFFField &field)
     {
-        SFFReadHeader *header = new SFFReadHeader(); 
+        if (raw)
+            return read_raw_field(field); 
+        /* Read into the storage owned by field so that recycled fields
+         * do not allocate */
+        SFFReadHeader *header = field.get_header_storage(); 
         bool headerRead = read_field_header(header);
         if (!headerRead)
             return false; 
-        SFFReadData *data = new SFFReadData(field.get_flow_len(), header->nbases); 
+        SFFReadData *data = field.get_data_storage(); 
+        data->resize(field.get_flow_len(), header->nbases); 
         bool dataRead = read_field_data(data); 
         if (!dataRead)
             return false;
+        consumed += padded_size(header->get_size()) + 
+                    padded_size(data->get_size()); 
         field.set_header(header); 
         field.set_data(data);
         return field.validate();
    }
 
+    bool SFFFileReader::read_raw_field(SFFField &field)
+    {
+        std::vector<char> &record = field.get_record_storage(); 
+        if (record.size() < READ_HEADER_FIXED_SIZE)
+            record.resize(READ_HEADER_FIXED_SIZE); 
+        ifs.read(&record[0], READ_HEADER_FIXED_SIZE); 
+        if (!good()) return false; 
+
+        /* Now that we know its size, read the rest of the record */
+        uint64_t size = record_size(&record[0], flow_len); 
+        if (record.size() < size)
+            record.resize(size); 
+        ifs.read(&record[READ_HEADER_FIXED_SIZE], 
+                 size - READ_HEADER_FIXED_SIZE); 
+        /* Like read_padding, tolerate a last read missing some of its 
+         * padding, which is written back as zeros */
+        uint64_t got = READ_HEADER_FIXED_SIZE + ifs.gcount(); 
+        if (got < size)
+        {
+            if (got < unpadded_record_size(&record[0], flow_len))
+                return false; 
+            std::fill(record.begin() + got, record.begin() + size, 0); 
+            ifs.clear(std::ios::eofbit); 
+        }
+        consumed += size; 
+
+        SFFReadView view; 
+        parse_record(&record[0], flow_len, view); 
+        field.set_view(view); 
+        return field.validate(); 
+    }
+
     bool SFFFileReader::read_padding(int size)
     {
         int remainder = PADDING_SIZE - (size % PADDING_SIZE);
@@ -441,28 +913,641 @@ namespace sff
         return true;
     }
     
-    /* Begin SFFFileWriter implementation 
-     * We open of outfile stream in mode binary | in so we can write 
-     * binary data and update the common header in place after we have
-     * figured out how many reads match an adaptor. We keep a counter
-     * of reads we successfully write. 
-     */
-    SFFFileWriter::SFFFileWriter(const std::string &filename) : 
-        ofs(filename.c_str(), std::ios::out |
-                              std::ios::trunc |
-                              std::ios::binary | 
-                              std::ios::in),
-        nreads(0)
+    /*** Begin SFFMappedReader implementation ***/
+    SFFMappedReader::SFFMappedReader(const std::string &filename, bool decode) :
+        fd(-1),
+        map(NULL),
+        map_size(0),
+        pos(0),
+        reads_end(0),
+        flow_len(0),
+        decode(decode),
+        ok(true)
+    {
+        fd = open(filename.c_str(), O_RDONLY); 
+        if (fd < 0)
+            throw std::runtime_error("Could not open file for reading");
+        struct stat st; 
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd); 
+            throw std::runtime_error("Could not stat file for reading");
+        }
+        map_size = st.st_size; 
+        reads_end = map_size; 
+        if (map_size > 0)
+        {
+            void *m = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0); 
+            if (m == MAP_FAILED)
+            {
+                close(fd); 
+                throw std::runtime_error("Could not memory map file for reading");
+            }
+            /* Reads are consumed front to back */
+            madvise(m, map_size, MADV_SEQUENTIAL); 
+            map = static_cast<const char*>(m); 
+        }
+    }
+
+    SFFMappedReader::~SFFMappedReader()
+    {
+        if (map != NULL)
+            munmap(const_cast<char*>(map), map_size); 
+        close(fd); 
+    }
+
+    bool SFFMappedReader::done()
+    {
+        return (pos >= reads_end); 
+    }
+
+    uint64_t SFFMappedReader::get_bytes_read()
+    {
+        return pos; 
+    }
+
+    bool SFFMappedReader::good()
+    {
+        return ok && (pos <= map_size); 
+    }
+
+    bool SFFMappedReader::skip_padding(uint64_t size)
+    {
+        pos += padded_size(size) - size; 
+        return (pos <= map_size); 
+    }
+
+    bool SFFMappedReader::read_common_header(SFFFileHeader &header)
+    {
+        /* magic, version, index_offset, index_len, nreads, 
+         * header_len, key_len, flow_len and flowgram_format */
+        const uint64_t fixed_size = 31; 
+        if (map_size < pos + fixed_size)
+            return (ok = false);
+        const char *p = map + pos; 
+        header.magic           = load_be32(p); 
+        memcpy(header.version, p+4, sizeof(header.version[0])*4); 
+        header.index_offset    = load_be64(p+8); 
+        header.index_len       = load_be32(p+16); 
+        header.nreads          = load_be32(p+20); 
+        header.header_len      = load_be16(p+24); 
+        header.key_len         = load_be16(p+26); 
+        header.flow_len        = load_be16(p+28); 
+        header.flowgram_format = *reinterpret_cast<const uint8_t*>(p+30); 
+        pos += fixed_size; 
+
+        /* Now we read the flow and the key */
+        if (map_size < pos + header.flow_len + header.key_len)
+            return (ok = false);
+        header.flow = std::vector<char>(map+pos, map+pos+header.flow_len); 
+        pos += header.flow_len; 
+        header.key = std::vector<char>(map+pos, map+pos+header.key_len); 
+        pos += header.key_len; 
+        flow_len = header.flow_len; 
+
+        /* the common header section is zero-byte padded to a 
+           multiple of 8-bytes */
+        if (!skip_padding(header.get_size()))
+            return (ok = false);
+        /* Reads run up to the index when it follows them */
+        if (header.index_len > 0 && header.index_offset >= pos && 
+            header.index_offset < map_size)
+            reads_end = header.index_offset; 
+        return header.validate(); 
+    }
+
+    bool SFFMappedReader::read_view(SFFReadView &view)
+    {
+        if (reads_end < pos + READ_HEADER_FIXED_SIZE)
+            return (ok = false);
+        const char *record = map + pos; 
+        if (reads_end < pos + unpadded_record_size(record, flow_len))
+            return (ok = false);
+        parse_record(record, flow_len, view); 
+        pos += std::min(view.record_len, reads_end - pos); 
+        return true; 
+    }
+
+    void SFFMappedReader::set_field_view(const SFFReadView &view, 
+                                         SFFField &field) const
     {
-        if (!ofs.is_open())
+        uint64_t available = map + reads_end - view.record; 
+        if (view.record_len <= available)
+        {
+            field.set_view(view); 
+            return; 
+        }
+        /* Like the stream reader, tolerate a last read missing some of
+         * its padding: it is copied with the padding written as zeros,
+         * so that the view does not reach past the reads */
+        std::vector<char> &record = field.get_record_storage(); 
+        record.assign(view.record_len, 0); 
+        memcpy(&record[0], view.record, available); 
+        SFFReadView copy; 
+        parse_record(&record[0], flow_len, copy); 
+        field.set_view(copy); 
+    }
+
+    bool SFFMappedReader::read_field(SFFField &field)
+    {
+        SFFReadView view; 
+        if (!read_view(view))
+            return false; 
+        set_field_view(view, field); 
+        if (decode)
+            field.decode_view(); 
+        return field.validate(); 
+    }
+
+    int SFFMappedReader::scan_records(int max_records, const char **chunk)
+    {
+        *chunk = map + pos; 
+        int nrecords = 0; 
+        while (nrecords < max_records && pos < reads_end)
+        {
+            if (reads_end < pos + READ_HEADER_FIXED_SIZE)
+                break; 
+            if (reads_end < pos + unpadded_record_size(map + pos, flow_len))
+                break; 
+            pos += std::min(record_size(map + pos, flow_len), reads_end - pos); 
+            nrecords ++; 
+        }
+        if (nrecords < max_records && pos < reads_end)
+        {
+            ok = false; 
+            return -1; 
+        }
+        return nrecords; 
+    }
+
+    bool SFFMappedReader::parse_fields(const char *chunk, int nrecords, 
+                                       const std::vector<SFFField*> &fields) const
+    {
+        for (int r = 0; r < nrecords; r++)
+        {
+            SFFField &field = *fields[r]; 
+            SFFReadView view; 
+            parse_record(chunk, flow_len, view); 
+            set_field_view(view, field); 
+            if (decode)
+                field.decode_view(); 
+            if (!field.validate())
+                return false; 
+            chunk += view.record_len; 
+        }
+        return true; 
+    }
+
+    /*** Begin SFFIndexedReader implementation ***/
+    /* Sidecar files start with a magic, then the size and modification
+     * time of the file they index, so that a stale index is not used */
+    #define SIDECAR_MAGIC "SFFIDX01"
+    #define SIDECAR_HEADER_SIZE 24
+
+    static bool sidecar_stamp(int fd, char *out)
+    {
+        struct stat st; 
+        if (fstat(fd, &st) != 0)
+            return false; 
+        memcpy(out, SIDECAR_MAGIC, 8); 
+        store_be64(out+8, st.st_size); 
+        store_be64(out+16, st.st_mtime); 
+        return true; 
+    }
+
+    SFFIndexedReader::SFFIndexedReader(const std::string &filename, 
+                                       bool decode) :
+        SFFMappedReader(filename, decode),
+        filename(filename),
+        reads_start(0),
+        index_source("")
+    {
+    }
+
+    bool SFFIndexedReader::read_common_header(SFFFileHeader &header)
+    {
+        if (!SFFMappedReader::read_common_header(header))
+            return false; 
+        reads_start = pos; 
+        index_source = "file"; 
+        if (header.index_len == 0 || header.index_offset >= map_size || 
+            !index.decode_roche(map + header.index_offset, 
+                                std::min((uint64_t)header.index_len, 
+                                         map_size - header.index_offset)))
+        {
+            /* Start over from an empty index after each failure */
+            index = SFFReadIndex(); 
+            index_source = "sidecar"; 
+            if (!load_sidecar())
+            {
+                index = SFFReadIndex(); 
+                index_source = "scan"; 
+                if (!build_index())
+                    return (ok = false); 
+            }
+        }
+        index.sort(); 
+        /* From now on, reads are looked up in no particular order */
+        if (map != NULL)
+            madvise(const_cast<char*>(map), map_size, MADV_RANDOM); 
+        return true; 
+    }
+
+    bool SFFIndexedReader::load_sidecar()
+    {
+        std::ifstream ifs((filename + SFF_INDEX_SIDECAR).c_str(), 
+                          std::ifstream::binary); 
+        if (!ifs.is_open())
+            return false; 
+        std::vector<char> in((std::istreambuf_iterator<char>(ifs)), 
+                             std::istreambuf_iterator<char>()); 
+        char stamp[SIDECAR_HEADER_SIZE]; 
+        if (in.size() < SIDECAR_HEADER_SIZE || !sidecar_stamp(fd, stamp) || 
+            memcmp(&in[0], stamp, SIDECAR_HEADER_SIZE) != 0)
+            return false; 
+        return index.decode_sidecar(&in[SIDECAR_HEADER_SIZE], 
+                                    in.size() - SIDECAR_HEADER_SIZE); 
+    }
+
+    bool SFFIndexedReader::build_index()
+    {
+        while (!done())
+        {
+            uint64_t at = pos; 
+            SFFReadView view; 
+            if (!read_view(view))
+                return false; 
+            index.add(view.name, view.name_len, at); 
+        }
+        index.sort(); 
+
+        /* Cache the index for the next run. Not being able to write 
+         * it, in a read-only directory for instance, is not an error */
+        std::vector<char> out(SIDECAR_HEADER_SIZE); 
+        if (!sidecar_stamp(fd, &out[0]))
+            return true; 
+        std::vector<char> entries; 
+        index.encode_sidecar(entries); 
+        out.insert(out.end(), entries.begin(), entries.end()); 
+        std::ofstream ofs((filename + SFF_INDEX_SIDECAR).c_str(), 
+                          std::ofstream::binary); 
+        ofs.write(&out[0], out.size()); 
+        return true; 
+    }
+
+    bool SFFIndexedReader::read_field(const std::string &name, SFFField &field)
+    {
+        uint64_t offset; 
+        if (!index.find(name, offset) || !read_field_at(offset, field))
+            return false; 
+        /* Guard against an index not matching the file */
+        return field.get_name() == name; 
+    }
+
+    bool SFFIndexedReader::read_field_at(uint64_t offset, SFFField &field)
+    {
+        if (offset < reads_start || 
+            reads_end < offset + READ_HEADER_FIXED_SIZE || 
+            reads_end < offset + unpadded_record_size(map + offset, flow_len))
+            return false; 
+        SFFReadView view; 
+        parse_record(map + offset, flow_len, view); 
+        set_field_view(view, field); 
+        if (decode)
+            field.decode_view(); 
+        return field.validate(); 
+    }
+
+    size_t SFFIndexedReader::find_offsets(const std::vector<std::string> &names, 
+                                          std::vector<uint64_t> &offsets) const
+    {
+        offsets.clear(); 
+        size_t missing = 0; 
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            uint64_t offset; 
+            if (index.find(names[i], offset))
+                offsets.push_back(offset); 
+            else
+                missing ++; 
+        }
+        /* Visiting reads in file order turns the lookups into a 
+         * forward sweep over the file. A read asked for twice is only
+         * read once */
+        std::sort(offsets.begin(), offsets.end()); 
+        offsets.erase(std::unique(offsets.begin(), offsets.end()), 
+                      offsets.end()); 
+        return missing; 
+    }
+
+    const char* SFFIndexedReader::get_index_source() const
+    {
+        return index_source; 
+    }
+
+    /*** Begin SFFWriteFlusher implementation ***/
+    SFFWriteFlusher::SFFWriteFlusher(size_t capacity) :
+        jobs(capacity), 
+        worker(&SFFWriteFlusher::run, this)
+    {
+    }
+
+    SFFWriteFlusher::~SFFWriteFlusher()
+    {
+        jobs.close(); 
+        worker.join(); 
+    }
+
+    void SFFWriteFlusher::submit(const Job &job)
+    {
+        jobs.push(job); 
+    }
+
+    void SFFWriteFlusher::run()
+    {
+        Job job; 
+        while (jobs.pop(job))
+        {
+            job.writer->write_at(job.buffer, job.offset, NULL, 0); 
+            job.buffer->clear(); 
+            /* The buffer can be filled again */
+            job.writer->release(job.buffer); 
+        }
+    }
+
+    /* Begin BufferedFileWriter implementation */
+    BufferedFileWriter::BufferedFileWriter(const std::string &filename, 
+                                           size_t buffer_size, 
+                                           SFFWriteFlusher *flusher, 
+                                           BGZFCompressor *compressor, 
+                                           bool stored_header) : 
+        filename(filename),
+        fd(-1),
+        buffer_size(buffer_size),
+        compressor(compressor),
+        buffer(NULL),
+        offset(0),
+        failed(false),
+        flusher(flusher),
+        stored_header(stored_header),
+        header_block_size(0),
+        compressed_end(0),
+        spare(2),
+        bytes_written(0),
+        write_ns(0),
+        compress_ns(0)
+    {
+        fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666); 
+        if (fd < 0)
             throw std::runtime_error("Could not open file for writing");
+        /* Buffers grow as data comes, so small outputs stay small */
+        buffer = new std::vector<char>(); 
+        if (flusher != NULL)
+            spare.push(new std::vector<char>()); 
     }
 
-    SFFFileWriter::~SFFFileWriter()
+    BufferedFileWriter::~BufferedFileWriter()
     {
-        ofs.close();
+        flush(); 
+        if (compressor != NULL && reopen())
+        {
+            std::vector<char> eof; 
+            BGZFCompressor::eof_block(eof); 
+            write_raw(&eof[0], eof.size(), compressed_end, NULL, 0); 
+        }
+        if (fd >= 0)
+            close(fd); 
+        delete buffer; 
+        spare.close(); 
+        std::vector<char> *b; 
+        while (spare.pop(b))
+            delete b; 
     }
     
+    const std::string& BufferedFileWriter::get_filename() const
+    {
+        return filename; 
+    }
+
+    uint64_t BufferedFileWriter::get_bytes_written() const
+    {
+        return bytes_written; 
+    }
+
+    double BufferedFileWriter::get_write_seconds() const
+    {
+        return write_ns * 1e-9; 
+    }
+
+    double BufferedFileWriter::get_compress_seconds() const
+    {
+        return compress_ns * 1e-9; 
+    }
+
+    bool BufferedFileWriter::flush()
+    {
+        /* A released writer has nothing buffered */
+        if (fd < 0)
+            return !failed; 
+        write_buffer(); 
+        if (flusher != NULL)
+        {
+            /* Wait for the other buffer to be written */
+            std::vector<char> *b; 
+            if (spare.pop(b))
+                spare.push(b); 
+            else
+                failed = true; 
+        }
+        return !failed; 
+    }
+
+    bool BufferedFileWriter::release_file()
+    {
+        if (fd < 0)
+            return !failed; 
+        bool ok = flush(); 
+        /* Give the memory back, the buffers grow again on reuse */
+        std::vector<char>().swap(*buffer); 
+        if (flusher != NULL)
+        {
+            std::vector<char> *b; 
+            if (spare.pop(b))
+            {
+                std::vector<char>().swap(*b); 
+                spare.push(b); 
+            }
+            else
+                ok = false; 
+        }
+        close(fd); 
+        fd = -1; 
+        return ok; 
+    }
+
+    bool BufferedFileWriter::is_open() const
+    {
+        return (fd >= 0); 
+    }
+
+    bool BufferedFileWriter::reopen()
+    {
+        if (fd >= 0)
+            return true; 
+        /* Offsets are tracked by the writer, the file is neither
+         * truncated nor appended to */
+        fd = open(filename.c_str(), O_WRONLY); 
+        if (fd < 0)
+        {
+            std::cerr << "Could not reopen output file: " 
+                      << strerror(errno) << std::endl; 
+            failed = true; 
+            return false; 
+        }
+        return true; 
+    }
+
+    char* BufferedFileWriter::reserve(uint64_t size)
+    {
+        if (!buffer->empty() && buffer->size() + size > buffer_size)
+            write_buffer(); 
+        buffer->resize(buffer->size() + size); 
+        return &(*buffer)[buffer->size() - size]; 
+    }
+
+    bool BufferedFileWriter::write_buffer(const char *extra, uint64_t extra_len)
+    {
+        if (buffer->empty() && extra_len == 0)
+            return !failed; 
+        if (flusher == NULL || extra_len > 0)
+        {
+            write_at(buffer, offset, extra, extra_len); 
+            offset += buffer->size() + extra_len; 
+            buffer->clear(); 
+            return !failed; 
+        }
+        /* Hand the buffer to the flusher and fill the other one, once
+         * it has been written */
+        SFFWriteFlusher::Job job = {this, buffer, offset}; 
+        offset += buffer->size(); 
+        flusher->submit(job); 
+        if (!spare.pop(buffer))
+        {
+            /* The flusher owns the buffer submitted, never fill it */
+            buffer = new std::vector<char>(); 
+            failed = true; 
+        }
+        return !failed; 
+    }
+
+    bool BufferedFileWriter::write_at(std::vector<char> *data, uint64_t at, 
+                                      const char *extra, uint64_t extra_len)
+    {
+        if (compressor != NULL)
+            return write_compressed(*data, at); 
+        return write_raw(data->empty() ? NULL : &(*data)[0], data->size(), 
+                         at, extra, extra_len); 
+    }
+
+    bool BufferedFileWriter::write_compressed(const std::vector<char> &data, 
+                                              uint64_t at)
+    {
+        /* Only the stored header is written at offset 0, everything 
+         * else is appended after the last block */
+        std::vector<char> out; 
+        bool compressed; 
+        double start = now(); 
+        bool header = (at == 0 && stored_header); 
+        if (header)
+            compressed = BGZFCompressor::compress_stored(
+                    data.data(), data.size(), out) && 
+                (header_block_size == 0 || out.size() == header_block_size); 
+        else
+            compressed = compressor->compress(data.data(), data.size(), out); 
+        compress_ns += (uint64_t)((now() - start) * 1e9); 
+        if (!compressed)
+        {
+            std::cerr << "Could not compress output" << std::endl; 
+            failed = true; 
+            return false; 
+        }
+        if (header)
+        {
+            if (header_block_size == 0)
+                compressed_end = header_block_size = out.size(); 
+            return write_raw(&out[0], out.size(), 0, NULL, 0); 
+        }
+        uint64_t end = compressed_end; 
+        compressed_end += out.size(); 
+        return write_raw(out.empty() ? NULL : &out[0], out.size(), end, 
+                         NULL, 0); 
+    }
+
+    bool BufferedFileWriter::write_raw(const char *data, uint64_t len, 
+                                       uint64_t at, const char *extra, 
+                                       uint64_t extra_len)
+    {
+        struct iovec iov[2]; 
+        iov[0].iov_base = const_cast<char*>(data); 
+        iov[0].iov_len = len; 
+        iov[1].iov_base = const_cast<char*>(extra); 
+        iov[1].iov_len = extra_len; 
+        int iovcnt = (extra_len > 0) ? 2 : 1; 
+        struct iovec *v = iov; 
+        double start = now(); 
+        while (iovcnt > 0)
+        {
+            ssize_t n = pwritev(fd, v, iovcnt, at); 
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue; 
+                std::cerr << "Could not write to output file: " 
+                          << strerror(errno) << std::endl; 
+                failed = true; 
+                return false; 
+            }
+            at += n; 
+            bytes_written += n; 
+            /* Partial write, move past what was written */
+            while (iovcnt > 0 && (size_t)n >= v->iov_len)
+            {
+                n -= v->iov_len; 
+                v++; 
+                iovcnt--; 
+            }
+            if (iovcnt > 0)
+            {
+                v->iov_base = static_cast<char*>(v->iov_base) + n; 
+                v->iov_len -= n; 
+            }
+        }
+        write_ns += (uint64_t)((now() - start) * 1e9); 
+        return true; 
+    }
+
+    void BufferedFileWriter::release(std::vector<char> *b)
+    {
+        spare.push(b); 
+    }
+
+    /* Begin SFFFileWriter implementation 
+     * Reads are written at increasing offsets, and the common header
+     * is written in place at the beginning of the file, so it can be 
+     * updated after we have figured out how many reads match an 
+     * adaptor. We keep a counter of reads we successfully write. 
+     */
+    SFFFileWriter::SFFFileWriter(const std::string &filename, 
+                                 size_t buffer_size, 
+                                 SFFWriteFlusher *flusher, 
+                                 BGZFCompressor *compressor) : 
+        BufferedFileWriter(filename, buffer_size, flusher, compressor, true),
+        nreads(0),
+        index_offset(0),
+        index_len(0)
+    {
+    }
+
     int SFFFileWriter::get_number_of_fields_written()
     {
         return nreads;
@@ -474,112 +1559,574 @@ namespace sff
          * matching adaptor. The rest of the common header does not need to change
          * but we still re-write the full common header for cleaner code
          */
-        ofs.seekp(std::ofstream::beg); 
-        SFFFileHeader h(header); 
-        h.big_endian_to_host(); 
-        ofs.write(reinterpret_cast<char*>(&h.magic),
-                  sizeof(h.magic)); 
-        ofs.write(reinterpret_cast<char*>(&h.version[0]),
-                  sizeof(char)*4); 
-        ofs.write(reinterpret_cast<char*>(&h.index_offset),
-                  sizeof(h.index_offset));
-        ofs.write(reinterpret_cast<char*>(&h.index_len), 
-                  sizeof(h.index_len));
-        ofs.write(reinterpret_cast<char*>(&h.nreads),  
-                  sizeof(h.nreads));
-        ofs.write(reinterpret_cast<char*>(&h.header_len), 
-                  sizeof(h.header_len));
-        ofs.write(reinterpret_cast<char*>(&h.key_len),    
-                  sizeof(h.key_len));
-        ofs.write(reinterpret_cast<char*>(&h.flow_len), 
-                  sizeof(h.flow_len));
-        ofs.write(reinterpret_cast<char*>(&h.flowgram_format), 
-                  sizeof(h.flowgram_format));
-        ofs.write(reinterpret_cast<char*>(&h.flow[0]),         
-                  sizeof(char)*header.flow_len);
-        ofs.write(reinterpret_cast<char*>(&h.key[0]),  
-                  sizeof(char)*header.key_len);
-
-        int header_size = header.get_size();  
-        if ( !(header_size % PADDING_SIZE == 0) ) {
-            write_padding(header_size);
-        }
+        if (!is_open() || !flush())
+            return false; 
+        SFFFileHeader own(header); 
+        own.index_offset = index_offset; 
+        own.index_len = index_len; 
+        std::vector<char> h; 
+        encode_common_header(own, h); 
+        if (!write_at(&h, 0, NULL, 0))
+            return false; 
+        /* Reads follow the header */
+        if (offset == 0)
+            offset = h.size(); 
         return true;
     }
 
+    void SFFFileWriter::encode_common_header(const SFFFileHeader &header, 
+                                             std::vector<char> &out)
+    {
+        /* the common header section is zero-byte padded to a 
+           multiple of 8-bytes */
+        out.assign(padded_size(header.get_size()), 0); 
+        char *p = &out[0]; 
+        store_be32(p, header.magic); 
+        memcpy(p+4, header.version, sizeof(char)*4); 
+        store_be32(p+8,  header.index_offset >> 32); 
+        store_be32(p+12, header.index_offset & 0xffffffff); 
+        store_be32(p+16, header.index_len); 
+        store_be32(p+20, header.nreads); 
+        store_be16(p+24, header.header_len); 
+        store_be16(p+26, header.key_len); 
+        store_be16(p+28, header.flow_len); 
+        p[30] = header.flowgram_format; 
+        memcpy(p+31, &header.flow[0], sizeof(char)*header.flow_len); 
+        memcpy(p+31+header.flow_len, &header.key[0], 
+               sizeof(char)*header.key_len); 
+    }
+
     bool SFFFileWriter::write_field(SFFField &read)
     {
-        bool writeHeader = write_field_header(read.get_header());
-        bool writeData = write_field_data(read.get_data()); 
-        return (writeHeader && writeData); 
-    }
-
-    bool SFFFileWriter::write_field_header(const SFFReadHeader *header)
-    {
-        /* Make a copy of header to be written as we need to flip endian */
-        SFFReadHeader h(*header);
-        h.big_endian_to_host(); 
-        ofs.write(reinterpret_cast<char*>(&h.header_len), 
-                  sizeof(h.header_len));
-        ofs.write(reinterpret_cast<char*>(&h.name_len), 
-                  sizeof(h.name_len));
-        ofs.write(reinterpret_cast<char*>(&h.nbases), 
-                  sizeof(h.nbases));
-        ofs.write(reinterpret_cast<char*>(&h.clip_qual_left), 
-                  sizeof(h.clip_qual_left));
-        ofs.write(reinterpret_cast<char*>(&h.clip_qual_right), 
-                  sizeof(h.clip_qual_right));
-        ofs.write(reinterpret_cast<char*>(&h.clip_adapter_left), 
-                  sizeof(h.clip_adapter_left));
-        ofs.write(reinterpret_cast<char*>(&h.clip_adapter_right), 
-                  sizeof(h.clip_adapter_right));
-        ofs.write(h.name.c_str(), h.name.size());
+        if (!is_open())
+            return false; 
+        if (read.is_view())
+            return write_field_view(read.get_view()); 
+        /* Serialize the whole read, padding included, straight into 
+         * the output buffer */
+        const SFFReadHeader *header = read.get_header(); 
+        const SFFReadData *data = read.get_data(); 
+        uint64_t header_size = padded_size(header->get_size()); 
+        uint64_t data_size = padded_size(data->get_size()); 
+        char *out = reserve(header_size + data_size); 
+        index.add(header->name.data(), header->name_len, 
+                  offset + (out - &(*buffer)[0])); 
+        encode_field_header(header, out); 
+        encode_field_data(data, out + header_size); 
+        if (failed)
+            return false; 
+        nreads++; 
+        return true; 
+    }
+
+    void SFFFileWriter::append_field(SFFField &read, std::vector<char> &out)
+    {
+        if (read.is_view())
+        {
+            const SFFReadView &view = read.get_view(); 
+            out.insert(out.end(), view.record, view.record + view.record_len); 
+            patch_adaptor_clips(view, &out[out.size() - view.record_len]); 
+            return; 
+        }
+        const SFFReadHeader *header = read.get_header(); 
+        const SFFReadData *data = read.get_data(); 
+        uint64_t header_size = padded_size(header->get_size()); 
+        uint64_t data_size = padded_size(data->get_size()); 
+        out.resize(out.size() + header_size + data_size); 
+        char *p = &out[out.size() - header_size - data_size]; 
+        encode_field_header(header, p); 
+        encode_field_data(data, p + header_size); 
+    }
+
+    void SFFFileWriter::encode_field_header(const SFFReadHeader *header, 
+                                            char *out)
+    {
+        store_be16(out,    header->header_len); 
+        store_be16(out+2,  header->name_len); 
+        store_be32(out+4,  header->nbases); 
+        store_be16(out+8,  header->clip_qual_left); 
+        store_be16(out+10, header->clip_qual_right); 
+        store_be16(out+12, header->clip_adapter_left); 
+        store_be16(out+14, header->clip_adapter_right); 
+        memcpy(out+16, header->name.data(), header->name_len); 
 
         /* the section should be a multiple of 8-bytes, if not,
            it is zero-byte padded to make it so */
         int header_size = header->get_size();  
-        bool writePadding = true; 
-        if ( !(header_size % PADDING_SIZE == 0) ) {
-            writePadding = write_padding(header_size);
-        }
-        if (writePadding)
-            nreads++; 
-        return writePadding; 
+        memset(out+header_size, 0, padded_size(header_size)-header_size); 
     }
 
-    bool SFFFileWriter::write_field_data(const SFFReadData *data)
+    void SFFFileWriter::encode_field_data(const SFFReadData *data, char *out)
     {
-        /* Make a copy of data to be written as we need to flip endian */
-        SFFReadData d(*data); 
-        d.big_endian_to_host(); 
-
         int data_size = data->get_size();  
         int flow_len = data->flowgram.size(); 
         int nbases = data->bases.size(); 
-        ofs.write(reinterpret_cast<char*>(&d.flowgram[0]),   
-                  sizeof(d.flowgram[0])*flow_len);
-        ofs.write(reinterpret_cast<char*>(&d.flow_index[0]), 
-                  sizeof(d.flow_index[0])*nbases);
-        ofs.write(reinterpret_cast<char*>(&d.bases[0]),      
-                  sizeof(d.bases[0])*nbases);
-        ofs.write(reinterpret_cast<char*>(&d.quality[0]),    
-                  sizeof(d.quality[0])*nbases);
+        /* Only the flowgram needs to flip endian. It is swapped 
+         * straight into the output */
+        convert_be16(reinterpret_cast<uint16_t*>(out), 
+                     &data->flowgram[0], flow_len); 
+        out += sizeof(data->flowgram[0])*flow_len; 
+        memcpy(out, &data->flow_index[0], 
+               sizeof(data->flow_index[0])*nbases); 
+        out += sizeof(data->flow_index[0])*nbases; 
+        memcpy(out, &data->bases[0], sizeof(data->bases[0])*nbases); 
+        out += sizeof(data->bases[0])*nbases; 
+        memcpy(out, &data->quality[0], sizeof(data->quality[0])*nbases); 
+        out += sizeof(data->quality[0])*nbases; 
 
         /* the section should be a multiple of 8-bytes, if not,
            it is padded to make it so */
-        bool writePadding = true;              
-        if ( !(data_size % PADDING_SIZE == 0) ) {
-            writePadding = write_padding(data_size);
+        memset(out, 0, padded_size(data_size)-data_size); 
+    }
+
+    bool SFFFileWriter::write_field_view(const SFFReadView &view)
+    {
+        /* A viewed read is still in its on-disk big-endian layout, 
+         * padding included, so it is copied verbatim, but for its 
+         * adaptor clips
+         */
+        if (view.record_len >= buffer_size && compressor == NULL && 
+            load_be16(view.record+12) == view.clip_adapter_left && 
+            load_be16(view.record+14) == view.clip_adapter_right)
+        {
+            /* Too large to be worth buffering */
+            index.add(view.name, view.name_len, offset + buffer->size()); 
+            write_buffer(view.record, view.record_len); 
+        }
+        else
+        {
+            if (buffer->size() + view.record_len > buffer_size)
+                write_buffer(); 
+            index.add(view.name, view.name_len, offset + buffer->size()); 
+            buffer->insert(buffer->end(), view.record, 
+                           view.record + view.record_len); 
+            patch_adaptor_clips(view, &(*buffer)[buffer->size() - view.record_len]); 
         }
-        return writePadding;
+        if (failed)
+            return false; 
+        nreads++; 
+        return true; 
     }
 
-    bool SFFFileWriter::write_padding(int size)
+    void SFFFileWriter::patch_adaptor_clips(const SFFReadView &view, 
+                                            char *record)
     {
-        int remainder = PADDING_SIZE - (size % PADDING_SIZE);
-        char padding[remainder];
-        ofs.write(padding, sizeof(uint8_t)*remainder); 
-        return true;
+        store_be16(record+12, view.clip_adapter_left); 
+        store_be16(record+14, view.clip_adapter_right); 
+    }
+
+    bool SFFFileWriter::write_index()
+    {
+        if (!is_open() || !flush())
+            return false; 
+        if (index.get_max_offset() > SRT_MAX_OFFSET)
+        {
+            std::cerr << "Output too large to be indexed, "
+                      << "writing it without index" << std::endl; 
+            return true; 
+        }
+        index.sort(); 
+        std::vector<char> out; 
+        index.encode_roche(out); 
+        /* Padding is not counted in index_len */
+        index_len = out.size(); 
+        out.resize(padded_size(out.size()), 0); 
+        /* The index goes right after the last read */
+        if (!write_at(&out, offset, NULL, 0))
+            return false; 
+        index_offset = offset; 
+        offset += out.size(); 
+        return true; 
+    }
+
+    /* Begin SequenceFileWriter implementation */
+    SequenceFileWriter::SequenceFileWriter(const std::string &filename, 
+                                           SequenceFormat format, 
+                                           size_t buffer_size, 
+                                           SFFWriteFlusher *flusher, 
+                                           BGZFCompressor *compressor) : 
+        BufferedFileWriter(filename, buffer_size, flusher, compressor),
+        format(format),
+        nreads(0)
+    {
+    }
+
+    int SequenceFileWriter::get_number_of_fields_written()
+    {
+        return nreads; 
+    }
+
+    bool SequenceFileWriter::write_field(const SFFField &read, 
+                                         int left, int right)
+    {
+        if (!is_open())
+            return false; 
+        const SFFReadView &view = read.get_view(); 
+        left = std::max(0, left); 
+        right = std::min(right, (int)view.nbases); 
+        int nbases = std::max(0, right - left); 
+        /* Room for the longest record, the unused end is given back */
+        uint64_t size = 1 + view.name_len + 1 + 
+                        (format == QUAL ? 4 : 2) * nbases + 4; 
+        char *out = reserve(size); 
+        char *p = out; 
+        *p++ = (format == FASTQ) ? '@' : '>'; 
+        memcpy(p, view.name, view.name_len); 
+        p += view.name_len; 
+        *p++ = '\n'; 
+        if (format != QUAL)
+        {
+            memcpy(p, view.bases + left, nbases); 
+            p += nbases; 
+            *p++ = '\n'; 
+        }
+        if (format == FASTQ)
+        {
+            *p++ = '+'; 
+            *p++ = '\n'; 
+            for (int b = 0; b < nbases; b++)
+                *p++ = (char)(view.quality[left + b] + 33); 
+            *p++ = '\n'; 
+        }
+        else if (format == QUAL)
+        {
+            for (int b = 0; b < nbases; b++)
+            {
+                int q = view.quality[left + b]; 
+                if (b > 0)
+                    *p++ = ' '; 
+                if (q >= 100)
+                    *p++ = '0' + q / 100; 
+                if (q >= 10)
+                    *p++ = '0' + q / 10 % 10; 
+                *p++ = '0' + q % 10; 
+            }
+            *p++ = '\n'; 
+        }
+        buffer->resize(buffer->size() - (size - (p - out))); 
+        if (failed)
+            return false; 
+        nreads++; 
+        return true; 
+    }
+
+    /* Begin SFFContainerWriter implementation */
+    SFFContainerWriter::SFFContainerWriter(const std::string &filename, 
+                                           size_t chunk_size, 
+                                           size_t memory_limit) : 
+        fd(-1),
+        chunk_size(chunk_size),
+        memory_limit(std::max(memory_limit, chunk_size)),
+        buffered(0),
+        offset(0),
+        failed(false),
+        index_offset(0),
+        index_len(0)
+    {
+        fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666); 
+        if (fd < 0)
+            throw std::runtime_error("Could not open file for writing");
+    }
+
+    SFFContainerWriter::~SFFContainerWriter()
+    {
+        ::close(fd); 
+    }
+
+    bool SFFContainerWriter::write_common_header(const SFFFileHeader &header)
+    {
+        SFFFileHeader own(header); 
+        own.index_offset = index_offset; 
+        own.index_len = index_len; 
+        std::vector<char> h; 
+        SFFFileWriter::encode_common_header(own, h); 
+        if (!write_raw(&h[0], h.size(), 0))
+            return false; 
+        /* Extents follow the header */
+        if (offset == 0)
+            offset = h.size(); 
+        return true; 
+    }
+
+    bool SFFContainerWriter::write_field(const std::string &adaptor, 
+                                         SFFField &read)
+    {
+        std::unordered_map<std::string, uint32_t>::const_iterator found = 
+            ids.find(adaptor); 
+        uint32_t id; 
+        if (found == ids.end())
+        {
+            id = adaptors.size(); 
+            adaptors.push_back(Adaptor()); 
+            adaptors[id].summary.name = adaptor; 
+            adaptors[id].summary.nreads = 0; 
+            adaptors[id].summary.bytes = 0; 
+            adaptors[id].summary.write_seconds = 0; 
+            adaptors[id].buffered_reads = 0; 
+            ids[adaptor] = id; 
+        }
+        else
+            id = found->second; 
+        std::vector<char> &buffer = adaptors[id].buffer; 
+        size_t before = buffer.size(); 
+        SFFFileWriter::append_field(read, buffer); 
+        buffered += buffer.size() - before; 
+        adaptors[id].buffered_reads++; 
+        if (buffer.size() >= chunk_size)
+            return write_extent(id); 
+        if (buffered > memory_limit)
+        {
+            /* Make room by writing the largest buffer */
+            uint32_t largest = 0; 
+            for (uint32_t a = 1; a < adaptors.size(); a++)
+                if (adaptors[a].buffer.size() > adaptors[largest].buffer.size())
+                    largest = a; 
+            return write_extent(largest); 
+        }
+        return !failed; 
+    }
+
+    bool SFFContainerWriter::write_extent(uint32_t id)
+    {
+        Adaptor &adaptor = adaptors[id]; 
+        if (adaptor.buffer.empty())
+            return !failed; 
+        uint64_t len = adaptor.buffer.size(); 
+        double start = now(); 
+        bool ok = write_raw(&adaptor.buffer[0], len, offset); 
+        adaptor.summary.write_seconds += now() - start; 
+        Extent extent = {id, offset, adaptor.buffered_reads, len}; 
+        extents.push_back(extent); 
+        adaptor.summary.nreads += adaptor.buffered_reads; 
+        adaptor.summary.bytes += len; 
+        offset += len; 
+        buffered -= len; 
+        adaptor.buffered_reads = 0; 
+        /* Memory is only held by adaptors being buffered */
+        std::vector<char>().swap(adaptor.buffer); 
+        return ok; 
+    }
+
+    bool SFFContainerWriter::close(const SFFFileHeader &header)
+    {
+        uint32_t nreads = 0; 
+        for (uint32_t a = 0; a < adaptors.size(); a++)
+        {
+            if (!write_extent(a))
+                return false; 
+            nreads += adaptors[a].summary.nreads; 
+        }
+        std::vector<char> out; 
+        encode_index(out); 
+        /* Padding is not counted in index_len */
+        index_len = out.size(); 
+        out.resize(padded_size(out.size()), 0); 
+        if (!write_raw(&out[0], out.size(), offset))
+            return false; 
+        index_offset = offset; 
+        offset += out.size(); 
+        SFFFileHeader fixedHeader(header); 
+        fixedHeader.nreads = nreads; 
+        return write_common_header(fixedHeader); 
+    }
+
+    void SFFContainerWriter::get_adaptors(std::vector<AdaptorSummary> &out) const
+    {
+        for (size_t a = 0; a < adaptors.size(); a++)
+            out.push_back(adaptors[a].summary); 
+    }
+
+    void SFFContainerWriter::encode_index(std::vector<char> &out) const
+    {
+        out.assign(SFF_INDEX_MPX, SFF_INDEX_MPX + 8); 
+        char buf[8]; 
+        store_be32(buf, adaptors.size()); 
+        store_be32(buf+4, extents.size()); 
+        out.insert(out.end(), buf, buf+8); 
+        for (size_t a = 0; a < adaptors.size(); a++)
+        {
+            const AdaptorSummary &summary = adaptors[a].summary; 
+            store_be16(buf, summary.name.size()); 
+            out.insert(out.end(), buf, buf+2); 
+            out.insert(out.end(), summary.name.begin(), summary.name.end()); 
+            store_be32(buf, summary.nreads); 
+            out.insert(out.end(), buf, buf+4); 
+        }
+        for (size_t e = 0; e < extents.size(); e++)
+        {
+            store_be32(buf, extents[e].adaptor); 
+            out.insert(out.end(), buf, buf+4); 
+            store_be64(buf, extents[e].offset); 
+            out.insert(out.end(), buf, buf+8); 
+            store_be32(buf, extents[e].nreads); 
+            out.insert(out.end(), buf, buf+4); 
+            store_be64(buf, extents[e].len); 
+            out.insert(out.end(), buf, buf+8); 
+        }
+    }
+
+    bool SFFContainerWriter::write_raw(const char *data, uint64_t len, 
+                                       uint64_t at)
+    {
+        while (len > 0)
+        {
+            ssize_t n = pwrite(fd, data, len, at); 
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue; 
+                std::cerr << "Could not write to output file: " 
+                          << strerror(errno) << std::endl; 
+                failed = true; 
+                return false; 
+            }
+            data += n; 
+            len -= n; 
+            at += n; 
+        }
+        return true; 
+    }
+
+    /* Begin SFFContainerReader implementation */
+    SFFContainerReader::SFFContainerReader(const std::string &filename) : 
+        SFFMappedReader(filename)
+    {
+    }
+
+    bool SFFContainerReader::read_common_header(SFFFileHeader &h)
+    {
+        if (!SFFMappedReader::read_common_header(h))
+            return false; 
+        header = h; 
+        if (h.index_len == 0 || h.index_offset >= map_size || 
+            !decode_index(map + h.index_offset, 
+                          std::min((uint64_t)h.index_len, 
+                                   map_size - h.index_offset)))
+            return (ok = false); 
+        return true; 
+    }
+
+    bool SFFContainerReader::decode_index(const char *in, uint64_t len)
+    {
+        const char *end = in + len; 
+        if (len < 16 || memcmp(in, SFF_INDEX_MPX, 8) != 0)
+            return false; 
+        uint32_t nadaptors = load_be32(in+8); 
+        uint32_t nextents = load_be32(in+12); 
+        const char *p = in + 16; 
+        for (uint32_t a = 0; a < nadaptors; a++)
+        {
+            if (end - p < 2)
+                return false; 
+            uint16_t name_len = load_be16(p); 
+            if (end - p < 2 + name_len + 4)
+                return false; 
+            names.push_back(std::string(p+2, p+2+name_len)); 
+            counts.push_back(load_be32(p+2+name_len)); 
+            p += 2 + name_len + 4; 
+        }
+        if ((uint64_t)(end - p) < 24ULL*nextents)
+            return false; 
+        for (uint32_t e = 0; e < nextents; e++, p += 24)
+        {
+            uint32_t adaptor = load_be32(p); 
+            uint64_t offset = load_be64(p+4); 
+            if (adaptor >= nadaptors || offset >= reads_end)
+                return false; 
+            extent_adaptors.push_back(adaptor); 
+            extent_offsets.push_back(offset); 
+            extent_reads.push_back(load_be32(p+12)); 
+        }
+        return true; 
+    }
+
+    void SFFContainerReader::get_adaptor_names(std::vector<std::string> &out) const
+    {
+        out.insert(out.end(), names.begin(), names.end()); 
+    }
+
+    bool SFFContainerReader::extract(const std::string &adaptor, 
+                                     SFFFileWriter &writer)
+    {
+        std::vector<std::string>::const_iterator found = 
+            std::find(names.begin(), names.end(), adaptor); 
+        if (found == names.end())
+            return false; 
+        uint32_t id = found - names.begin(); 
+        SFFField field(header); 
+        SFFReadView view; 
+        /* Extents are in file order, reads are copied in one pass */
+        for (size_t e = 0; e < extent_adaptors.size(); e++)
+        {
+            if (extent_adaptors[e] != id)
+                continue; 
+            pos = extent_offsets[e]; 
+            for (uint32_t r = 0; r < extent_reads[e]; r++)
+            {
+                if (!read_view(view))
+                    return false; 
+                set_field_view(view, field); 
+                if (!writer.write_field(field))
+                    return false; 
+            }
+        }
+        return true; 
+    }
+
+    /* Begin SFFWriterCache implementation */
+    SFFWriterCache::SFFWriterCache(size_t max_open) :
+        max_open(std::max((size_t)1, max_open)),
+        releases(0)
+    {
+    }
+
+    bool SFFWriterCache::touch(BufferedFileWriter *writer)
+    {
+        std::unordered_map<BufferedFileWriter*, lrulist::iterator>::iterator 
+            entry = entries.find(writer); 
+        if (entry != entries.end())
+        {
+            /* Already open, now the most recently used */
+            lru.splice(lru.begin(), lru, entry->second); 
+            return true; 
+        }
+        if (!writer->reopen())
+            return false; 
+        lru.push_front(writer); 
+        entries[writer] = lru.begin(); 
+        if (lru.size() <= max_open)
+            return true; 
+        BufferedFileWriter *oldest = lru.back(); 
+        lru.pop_back(); 
+        entries.erase(oldest); 
+        releases++; 
+        return oldest->release_file(); 
+    }
+
+    void SFFWriterCache::remove(BufferedFileWriter *writer)
+    {
+        std::unordered_map<BufferedFileWriter*, lrulist::iterator>::iterator 
+            entry = entries.find(writer); 
+        if (entry == entries.end())
+            return; 
+        lru.erase(entry->second); 
+        entries.erase(entry); 
+    }
+
+    uint64_t SFFWriterCache::get_releases() const
+    {
+        return releases; 
+    }
+
+    size_t SFFWriterCache::get_max_open_files(size_t reserve)
+    {
+        struct rlimit limit; 
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || 
+            limit.rlim_cur == RLIM_INFINITY)
+            return 4096; 
+        if (limit.rlim_cur <= reserve)
+            return 1; 
+        return limit.rlim_cur - reserve; 
     }
 }
 
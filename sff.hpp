@@ -3,7 +3,14 @@
 
 #include <string>
 #include <vector>
+#include <list>
+#include <unordered_map>
 #include <fstream>
+#include <thread>
+#include <atomic>
+#include "pipeline.hpp"
+#include "instream.hpp"
+#include "bgzf.hpp"
 
 #if defined __linux__
   #include <endian.h>
@@ -55,6 +62,19 @@
 #define SFF_VERSION "\0\0\0\1"
 #define SFF_VERSION_LENGTH 4
 #define PADDING_SIZE 8
+/* Roche sorted read index: magic and version, then 4 null bytes */
+#define SFF_INDEX_SRT ".srt1.00"
+#define SFF_INDEX_HEADER_SIZE 12
+/* Roche manifest index: magic and version, XML and data sizes, then
+ * the XML manifest followed by a sorted read index */
+#define SFF_INDEX_MFT ".mft1.00"
+#define SFF_INDEX_MFT_HEADER_SIZE 16
+/* Index of a multiplexed output, see SFFContainerWriter */
+#define SFF_INDEX_MPX ".mpx1.00"
+/* Suffix of the index cached next to an input without index */
+#define SFF_INDEX_SIDECAR ".idx"
+/* Default size of the output buffer of each BufferedFileWriter */
+#define DEFAULT_WRITE_BUFFER_SIZE (4*1024*1024)
 
 namespace sff
 {
@@ -122,6 +142,8 @@ namespace sff
     {
         public: 
             SFFReadData(uint16_t flow_len, uint32_t nbases);
+            /* Resize for a new read, reusing allocated capacity */
+            void resize(uint16_t flow_len, uint32_t nbases); 
             std::vector<uint16_t> flowgram; 
             std::vector<uint8_t> flow_index;
             std::vector<char> bases;
@@ -133,10 +155,41 @@ namespace sff
             void big_endian_to_host();
     };
 
+    /* Lightweight, non-owning view of one read. Header values are in
+     * host order. name, bases, quality, flow_index and flowgram point
+     * straight into the memory the read was parsed from; flowgram is 
+     * left in big-endian order. record spans the whole on-disk read
+     * (header, data and padding) when the read was mapped or read raw.
+     */
+    struct SFFReadView
+    {
+        uint16_t header_len;
+        uint16_t name_len;
+        uint32_t nbases;
+        uint16_t clip_qual_left;
+        uint16_t clip_qual_right;
+        uint16_t clip_adapter_left;
+        uint16_t clip_adapter_right;
+        const char *name;
+        const uint16_t *flowgram;
+        const uint8_t *flow_index;
+        const char *bases;
+        const uint8_t *quality;
+        const char *record;
+        uint64_t record_len;
+    };
+
     /* Class representing one read. A read is composed of a header
      * and data. Header and data are gathered in the same class
      * because header helps instantiate data. It makes validation
      * easier, too. 
+     * A field is either backed by decoded SFFReadHeader/SFFReadData
+     * objects or by a SFFReadView into the original bytes of the read,
+     * in a memory mapped file or in the field's own record buffer. In
+     * the latter case get_header() and get_data() are not meaningful.
+     * The key is shared with the common header the field was built 
+     * from, which must outlive the field. A field owns its header and
+     * data; reading into a recycled field reuses their storage.
      */
     class SFFField 
     {
@@ -150,11 +203,35 @@ namespace sff
             std::string get_name() const; 
             int get_flow_len() const; 
             int get_key_len() const; 
-            std::vector<char> get_key() const;
+            const std::vector<char>& get_key() const;
             
-            /* Setters */
-            void set_header(const SFFReadHeader *header);
-            void set_data(const SFFReadData *data); 
+            /* Setters, the field takes ownership */
+            void set_header(SFFReadHeader *header);
+            void set_data(SFFReadData *data); 
+            void set_view(const SFFReadView &view); 
+            /* Bind the field to the common header of another file */
+            void set_common_header(const SFFFileHeader &header); 
+
+            /* Header and data storage owned by the field, allocated on 
+             * first use and reused by subsequent reads */
+            SFFReadHeader* get_header_storage(); 
+            SFFReadData* get_data_storage(); 
+            /* Buffer holding the on-disk bytes of a raw read */
+            std::vector<char>& get_record_storage(); 
+
+            /* View over the read. For decoded fields, flowgram and
+             * record are NULL since the decoded data is in host order. 
+             */
+            const SFFReadView& get_view() const; 
+            /* Whether the field is backed by a view over on-disk bytes */
+            bool is_view() const; 
+            /* Copy the view into the field's own header and data, in 
+             * host order. The field no longer depends on the view */
+            void decode_view(); 
+            /* Set the adaptor clips, 1-based as in the file. The bytes
+             * a view points to are left as they are: writers patch 
+             * the clips of the record they copy */
+            void set_adaptor_clips(uint16_t left, uint16_t right); 
 
             /* Validate the field is well constructed */
             bool validate() const; 
@@ -163,48 +240,494 @@ namespace sff
             int get_right_clip_value() const; 
 
             std::string get_left_adaptor_sequence(int size) const; 
+            /* Zero-copy version of get_left_adaptor_sequence. Points
+             * bases at the first base after the key and returns the 
+             * number of bases available, at most size.
+             */
+            int get_left_adaptor_bases(int size, const char **bases) const; 
+            /* Adaptor at the other end of the read: the bases past the
+             * right clip or, when the read is not clipped on the 
+             * right, its last bases. Points bases at the last size of
+             * them at most, none before the left clip, and returns 
+             * their number.
+             */
+            std::string get_right_adaptor_sequence(int size) const; 
+            int get_right_adaptor_bases(int size, const char **bases) const; 
 
         private:
             uint16_t key_len;
             uint16_t flow_len;
-            std::vector<char> key; 
-            const SFFReadHeader *header;
-            const SFFReadData *data;
+            const std::vector<char> *key; 
+            SFFReadHeader *header;
+            SFFReadData *data;
+            SFFReadView view; 
+            std::vector<char> record; 
+            bool viewed; 
     };
     
+    /* Name to offset index of the reads of a file. Names are stored
+     * back to back in a single buffer. Lookups require the index to 
+     * be sorted. The Roche encoding only holds offsets below 255^4.
+     */
+    class SFFReadIndex
+    {
+        public: 
+            void add(const char *name, uint16_t name_len, uint64_t offset); 
+            /* Sort entries by name, compared as bytes */
+            void sort(); 
+            /* Offset of the read called name, false if there is none */
+            bool find(const std::string &name, uint64_t &offset) const; 
+            size_t size() const; 
+            uint64_t get_max_offset() const; 
+
+            /* Roche .srt1.00 and .mft1.00 indexes, len excludes the 
+             * padding */
+            bool decode_roche(const char *in, uint64_t len); 
+            void encode_roche(std::vector<char> &out) const; 
+            /* Sidecar format, not limited to 4 GB: for each read, the
+             * name length (2 bytes), the name and the offset (8 bytes),
+             * big-endian */
+            bool decode_sidecar(const char *in, uint64_t len); 
+            void encode_sidecar(std::vector<char> &out) const; 
+        private: 
+            struct Entry
+            {
+                uint64_t offset; 
+                uint64_t name_pos; 
+                uint16_t name_len; 
+            }; 
+            std::vector<Entry> entries; 
+            std::vector<char> names; 
+    };
+
+    /* Virtual class for SFF readers, so the splitter can be driven
+     * by either the stream reader or the memory mapped reader
+     */
+    class VirtualSFFReader
+    {
+        public: 
+            virtual ~VirtualSFFReader() {}
+            virtual bool read_common_header(SFFFileHeader &header) = 0; 
+            virtual bool read_field(SFFField &field) = 0; 
+            virtual bool done() = 0; 
+            virtual bool good() = 0; 
+            /* Bytes of (decompressed) input consumed so far */
+            virtual uint64_t get_bytes_read() = 0; 
+    };
+
     /* Handle IO
+     * In raw mode, each read is copied as is, padding included, into
+     * the field's record buffer and the field is given a view over it.
+     * Only the fixed part of the read header is decoded, so the read 
+     * can be written back without being re-encoded.
+     * Reads end at the index, when the index follows them.
+     * The input can also be standard input ("-"), a FIFO or a gzip
+     * (zstd) compressed file, read and decompressed on a background 
+     * thread. It is never seeked.
      */
-    class SFFFileReader
+    class SFFFileReader : public VirtualSFFReader
     {
         public: 
-            SFFFileReader(const std::string &filename); 
+            SFFFileReader(const std::string &filename, bool raw=false); 
             ~SFFFileReader(); 
             bool read_common_header(SFFFileHeader &header); 
             bool read_field(SFFField &field); 
             bool done(); 
             bool good(); 
+            uint64_t get_bytes_read(); 
         private: 
             bool read_field_header(SFFReadHeader *header); 
             bool read_field_data(SFFReadData *data); 
             bool read_padding(int size); 
+            bool read_raw_field(SFFField &field); 
             bool validate_common_header(const SFFFileHeader &header); 
-            std::ifstream ifs; 
+            /* Plain files are read directly, anything else through a
+             * background thread */
+            std::filebuf file; 
+            InputStreamBuffer *stream; 
+            std::istream ifs; 
+            bool raw; 
+            uint16_t flow_len; 
+            uint64_t index_offset; // Reads stop here if not 0
+            uint64_t consumed;     // Bytes of header and reads read
+    };
+
+    /* Reader parsing the common header and reads in place from a 
+     * read-only memory map of the input. Fields are filled with a 
+     * SFFReadView, no per-read copy or allocation is made. Views stay
+     * valid for the lifetime of the reader. With decode, fields are 
+     * decoded from the view into their own header and data instead.
+     * Reads can also be split in chunks, a serial scan only finding 
+     * where reads start, and chunks parsed by parse_fields on any 
+     * number of threads. An index found right after the reads, as
+     * given by index_offset in the common header, is skipped.
+     */
+    class SFFMappedReader : public VirtualSFFReader
+    {
+        public: 
+            SFFMappedReader(const std::string &filename, bool decode=false); 
+            ~SFFMappedReader(); 
+            bool read_common_header(SFFFileHeader &header); 
+            bool read_field(SFFField &field); 
+            /* View of the next read. A last read may be missing some 
+             * of its padding, which record_len still counts */
+            bool read_view(SFFReadView &view); 
+            bool done(); 
+            bool good(); 
+            /* Offset of the next read to parse. Chunks handed to
+             * parse_fields count as read */
+            uint64_t get_bytes_read(); 
+
+            /* Skip over the next reads, at most max_records of them, 
+             * only looking at their sizes. chunk is set to the first 
+             * one. Returns the number of reads skipped, -1 if a read
+             * runs past the end of the file */
+            int scan_records(int max_records, const char **chunk); 
+            /* Parse the nrecords consecutive reads starting at chunk, 
+             * as found by scan_records, into fields. Thread safe */
+            bool parse_fields(const char *chunk, int nrecords, 
+                              const std::vector<SFFField*> &fields) const; 
+        protected: 
+            bool skip_padding(uint64_t size); 
+            /* Give field view, or a copy of its read padded with zeros 
+             * when the read is cut short of its padding */
+            void set_field_view(const SFFReadView &view, SFFField &field) const; 
+            int fd; 
+            const char *map; 
+            uint64_t map_size; 
+            uint64_t pos;      // Offset of the next byte to parse
+            uint64_t reads_end; // Reads stop here, at the index if any
+            uint16_t flow_len; 
+            bool decode; 
+            bool ok; 
+    };
+
+    /* Mapped reader looking reads up by name. The index is the one
+     * stored in the file, else one cached in a sidecar file next to 
+     * it (SFF_INDEX_SIDECAR), else it is built by scanning every read 
+     * and cached for the next run. Fields are views into the map.
+     */
+    class SFFIndexedReader : public SFFMappedReader
+    {
+        public: 
+            SFFIndexedReader(const std::string &filename, bool decode=false); 
+            /* Also loads or builds the index */
+            bool read_common_header(SFFFileHeader &header); 
+            /* Read called name into field, false if there is none */
+            bool read_field(const std::string &name, SFFField &field); 
+            /* Read starting at offset, as found by find_offsets */
+            bool read_field_at(uint64_t offset, SFFField &field); 
+            /* Offsets of the reads called names, sorted and without 
+             * duplicates so that reads are visited in file order. 
+             * Returns the number of names not found */
+            size_t find_offsets(const std::vector<std::string> &names, 
+                                std::vector<uint64_t> &offsets) const; 
+            /* Where the index came from: "file", "sidecar" or "scan" */
+            const char* get_index_source() const; 
+        private: 
+            bool load_sidecar(); 
+            bool build_index(); 
+            std::string filename; 
+            uint64_t reads_start; 
+            SFFReadIndex index; 
+            const char *index_source; 
+    };
+
+    class BufferedFileWriter; 
+
+    /* Background thread writing full BufferedFileWriter buffers to disk, 
+     * so that whoever fills the buffers does not wait on the disk. 
+     * One flusher can be shared by any number of writers.
+     */
+    class SFFWriteFlusher
+    {
+        public: 
+            SFFWriteFlusher(size_t capacity=16); 
+            /* Writes every pending buffer before returning */
+            ~SFFWriteFlusher(); 
+
+        private: 
+            friend class BufferedFileWriter; 
+            struct Job
+            {
+                BufferedFileWriter *writer; 
+                std::vector<char> *buffer; 
+                uint64_t offset; 
+            };
+            void submit(const Job &job); 
+            void run(); 
+            BoundedQueue<Job> jobs; 
+            std::thread worker; 
     };
 
-    class SFFFileWriter
+    /* Output file written through a large buffer, written to disk 
+     * with pwrite once full. Data that does not fit in an empty buffer
+     * is written along with the buffer by a single pwritev. 
+     * With a flusher, each writer owns two buffers: one is filled 
+     * while the other is being written in the background. 
+     * With a compressor, the file is written as BGZF blocks. With 
+     * stored_header, a header written at offset 0 is alone in a first
+     * block stored uncompressed, so it keeps its size and can be 
+     * rewritten in place. Data is then written in order, so data too 
+     * large for the buffer is buffered anyway.
+     * release_file closes the file and frees the buffers of a writer
+     * between uses. reopen opens it again, to be written at the offsets
+     * the writer kept track of. Writing to a released file fails.
+     */
+    class BufferedFileWriter
     {
         public:
-            SFFFileWriter(const std::string &filename); 
-            ~SFFFileWriter(); 
+            BufferedFileWriter(const std::string &filename, 
+                               size_t buffer_size=DEFAULT_WRITE_BUFFER_SIZE, 
+                               SFFWriteFlusher *flusher=NULL, 
+                               BGZFCompressor *compressor=NULL, 
+                               bool stored_header=false); 
+            virtual ~BufferedFileWriter(); 
+            /* Write buffered data and wait for background writes */
+            bool flush(); 
+            /* Flush, then close the file and free the buffers until 
+             * the writer is written to again */
+            bool release_file(); 
+            /* Open a released file again. Only SFFWriterCache reopens 
+             * files, so that it keeps count of those open, but for the
+             * destructor ending a compressed file */
+            bool reopen(); 
+            bool is_open() const; 
+            const std::string& get_filename() const; 
+            /* Bytes written to the file so far, compressed if so, and
+             * time spent in write calls and compressing. Writes made
+             * by the flusher count too */
+            uint64_t get_bytes_written() const; 
+            double get_write_seconds() const; 
+            double get_compress_seconds() const; 
+        protected: 
+            char* reserve(uint64_t size); 
+            bool write_buffer(const char *extra=NULL, uint64_t extra_len=0); 
+            bool write_at(std::vector<char> *buffer, uint64_t offset, 
+                          const char *extra, uint64_t extra_len); 
+            bool write_raw(const char *data, uint64_t len, uint64_t at, 
+                           const char *extra, uint64_t extra_len); 
+            bool write_compressed(const std::vector<char> &data, 
+                                  uint64_t offset); 
+            std::string filename; 
+            int fd; 
+            size_t buffer_size; 
+            BGZFCompressor *compressor; 
+            std::vector<char> *buffer;  // Data not written yet
+            uint64_t offset;   // File offset of the start of buffer
+            std::atomic<bool> failed; 
+        private: 
+            friend class SFFWriteFlusher; 
+            void release(std::vector<char> *buffer); 
+            SFFWriteFlusher *flusher; 
+            bool stored_header; 
+            /* Size of the compressed header, and file offset of the 
+             * next compressed block */
+            uint64_t header_block_size; 
+            uint64_t compressed_end; 
+            /* Buffers free to be filled, when flushing in background */
+            BoundedQueue<std::vector<char>*> spare; 
+            /* Updated by the writer and flusher threads, times are
+             * in nanoseconds */
+            std::atomic<uint64_t> bytes_written; 
+            std::atomic<uint64_t> write_ns; 
+            std::atomic<uint64_t> compress_ns; 
+    };
+
+    /* Reads are serialized into the buffer. The common header is 
+     * written in place at offset 0, so it can be rewritten once all 
+     * reads are written. 
+     * The offset of every read is recorded, and write_index appends a
+     * Roche sorted index (.srt1.00) after the reads. The index_offset
+     * and index_len of the common header are those of this index, 
+     * never the input's.
+     * Compressed files decompress to the same bytes as an 
+     * uncompressed output, index offsets included.
+     */
+    class SFFFileWriter : public BufferedFileWriter
+    {
+        public:
+            SFFFileWriter(const std::string &filename, 
+                          size_t buffer_size=DEFAULT_WRITE_BUFFER_SIZE, 
+                          SFFWriteFlusher *flusher=NULL, 
+                          BGZFCompressor *compressor=NULL); 
             bool write_common_header(const SFFFileHeader &header); 
             bool write_field(SFFField &read); 
+            /* Append the index of the reads written so far. Should be
+             * called once, after the last read and before the common 
+             * header is rewritten. Files too large for the 4 bytes
+             * offsets of the index are left without one */
+            bool write_index(); 
             int get_number_of_fields_written(); 
+
+            /* On-disk layout of a common header, and of a read appended
+             * to out, padding included. Views are copied as is */
+            static void encode_common_header(const SFFFileHeader &header, 
+                                             std::vector<char> &out); 
+            static void append_field(SFFField &read, std::vector<char> &out); 
         private: 
-            bool write_field_header(const SFFReadHeader *header);
-            bool write_field_data(const SFFReadData *data); 
-            bool write_padding(int size); 
-            std::ofstream ofs;
+            static void encode_field_header(const SFFReadHeader *header, 
+                                            char *out);
+            static void encode_field_data(const SFFReadData *data, char *out); 
+            bool write_field_view(const SFFReadView &view); 
+            /* Store the adaptor clips of view over those of a copy of
+             * its record */
+            static void patch_adaptor_clips(const SFFReadView &view, 
+                                            char *record); 
             int nreads;  // Number of reads we write to file
+            SFFReadIndex index; 
+            uint64_t index_offset; 
+            uint32_t index_len; 
+    };
+
+    /* Text formats of SequenceFileWriter */
+    enum SequenceFormat
+    {
+        FASTQ,   // name, bases and Phred+33 qualities
+        FASTA,   // name and bases
+        QUAL     // name and qualities, as numbers
+    };
+
+    /* Bases and qualities of reads, as text. Every record is on one 
+     * line, or two with FASTQ, whatever the number of bases. 
+     */
+    class SequenceFileWriter : public BufferedFileWriter
+    {
+        public: 
+            SequenceFileWriter(const std::string &filename, 
+                               SequenceFormat format, 
+                               size_t buffer_size=DEFAULT_WRITE_BUFFER_SIZE, 
+                               SFFWriteFlusher *flusher=NULL, 
+                               BGZFCompressor *compressor=NULL); 
+            /* Write bases [left, right) of read, 0-based. The range
+             * is cut to the read, and an empty range gives a record 
+             * without bases */
+            bool write_field(const SFFField &read, int left, int right); 
+            int get_number_of_fields_written(); 
+        private: 
+            SequenceFormat format; 
+            int nreads; 
+    };
+
+    /* Multiplexed output: the reads of every adaptor in a single file,
+     * as contiguous extents of reads of one adaptor. The reads of each
+     * adaptor are buffered, and a buffer is appended to the file as an
+     * extent once it holds chunk_size bytes, or once all buffers 
+     * together hold memory_limit bytes, the largest one first. 
+     * The file is a valid SFF file holding every read, followed by an
+     * index of the adaptors and their extents in file order:
+     *   SFF_INDEX_MPX, then the numbers of adaptors and of extents 
+     *   (4 bytes each),
+     *   per adaptor: name length (2 bytes), name, reads (4 bytes),
+     *   per extent: adaptor number (4 bytes), offset (8 bytes), reads 
+     *   (4 bytes), length (8 bytes), 
+     * all big-endian. index_len excludes the padding.
+     */
+    class SFFContainerWriter
+    {
+        public: 
+            SFFContainerWriter(const std::string &filename, 
+                               size_t chunk_size=DEFAULT_WRITE_BUFFER_SIZE, 
+                               size_t memory_limit=64*DEFAULT_WRITE_BUFFER_SIZE); 
+            ~SFFContainerWriter(); 
+            bool write_common_header(const SFFFileHeader &header); 
+            bool write_field(const std::string &adaptor, SFFField &read); 
+            /* Write what is buffered and the index, then update the 
+             * common header. Should be called once, after the last 
+             * read */
+            bool close(const SFFFileHeader &header); 
+
+            /* What was written for one adaptor */
+            struct AdaptorSummary
+            {
+                std::string name; 
+                uint32_t nreads; 
+                uint64_t bytes; 
+                double write_seconds; 
+            };
+            /* Adaptors in the order they were first seen */
+            void get_adaptors(std::vector<AdaptorSummary> &out) const; 
+        private: 
+            struct Adaptor
+            {
+                AdaptorSummary summary; 
+                uint32_t buffered_reads; 
+                std::vector<char> buffer; 
+            };
+            struct Extent
+            {
+                uint32_t adaptor; 
+                uint64_t offset; 
+                uint32_t nreads; 
+                uint64_t len; 
+            };
+            bool write_extent(uint32_t adaptor); 
+            bool write_raw(const char *data, uint64_t len, uint64_t at); 
+            void encode_index(std::vector<char> &out) const; 
+            int fd; 
+            size_t chunk_size; 
+            size_t memory_limit; 
+            size_t buffered;    // Bytes in all buffers
+            uint64_t offset;    // End of the file
+            bool failed; 
+            std::vector<Adaptor> adaptors; 
+            std::unordered_map<std::string, uint32_t> ids; 
+            std::vector<Extent> extents; 
+            uint64_t index_offset; 
+            uint32_t index_len; 
+    };
+
+    /* Reader of the files written by SFFContainerWriter, copying the
+     * reads of one adaptor out in a single forward pass over its 
+     * extents. read_common_header fails if the file has no 
+     * multiplexed index.
+     */
+    class SFFContainerReader : public SFFMappedReader
+    {
+        public: 
+            SFFContainerReader(const std::string &filename); 
+            /* Also loads the index */
+            bool read_common_header(SFFFileHeader &header); 
+            void get_adaptor_names(std::vector<std::string> &names) const; 
+            /* Write the reads of adaptor to writer, in file order. 
+             * False if there is no such adaptor */
+            bool extract(const std::string &adaptor, SFFFileWriter &writer); 
+        private: 
+            bool decode_index(const char *in, uint64_t len); 
+            SFFFileHeader header; 
+            std::vector<std::string> names; 
+            std::vector<uint32_t> counts; 
+            std::vector<uint32_t> extent_adaptors; 
+            std::vector<uint64_t> extent_offsets; 
+            std::vector<uint32_t> extent_reads; 
+    };
+
+    /* Bounds the number of files open, and so the memory held in 
+     * buffers, by any number of writers. Writers are used through 
+     * touch, which keeps the max_open most recently used ones open and
+     * releases the file of the least recently used one beyond that. 
+     * Not thread safe, meant to be used by the thread writing.
+     */
+    class SFFWriterCache
+    {
+        public: 
+            SFFWriterCache(size_t max_open); 
+            /* Mark writer as used, before writing to it, reopening 
+             * its file if it was released */
+            bool touch(BufferedFileWriter *writer); 
+            /* Forget writer, before it is deleted */
+            void remove(BufferedFileWriter *writer); 
+            /* Number of times a file was released to open another */
+            uint64_t get_releases() const; 
+            /* Files the process may open, from the resource limit, 
+             * less reserve for everything else */
+            static size_t get_max_open_files(size_t reserve); 
+        private: 
+            typedef std::list<BufferedFileWriter*> lrulist; 
+            size_t max_open; 
+            lrulist lru;   // Most recently used first
+            std::unordered_map<BufferedFileWriter*, lrulist::iterator> entries; 
+            uint64_t releases; 
     };
 }
 #endif
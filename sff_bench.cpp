@@ -0,0 +1,478 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "sff.hpp"
+#include "adaptors.hpp"
+#include "stats.hpp"
+
+#define PRG_NAME "sff_bench"
+/* Decoded reads kept in memory to benchmark encoding */
+#define ENCODE_SAMPLE 10000
+
+/* Benchmarks of the stages of sff_splitter on one input, usually made
+ * by sff_generate. Every benchmark is run -R times and the fastest run
+ * is reported, one line per benchmark with tab separated columns:
+ * benchmark, input, parameters, reads, bytes, seconds, reads per
+ * second and MB per second. Lines starting with '#' are comments.
+ */
+
+/* Required arguments */
+std::string infilename;
+std::string adaptorfilename;
+std::string outdir;
+std::string rightadaptorfilename;
+
+/* Options */
+std::string suites("read,match,write,e2e");
+std::string mismatches("0,1,2");
+std::string threads("1,2,4");
+std::string buffers("10,100,1000");
+std::string splitter("./sff_splitter");
+int repeats=3;
+bool header=true;
+
+void print_help_message()
+{
+    printf("Usage: %s %s\n", PRG_NAME, "[arguments]");
+    printf("\tRequired arguments:\n");
+    printf("\t\t%-20s%-20s\n", "-i <input.sff>", "Input to benchmark on");
+    printf("\t\t%-20s%-20s\n", "-a <adaptors.txt>", "Adaptors to match");
+    printf("\t\t%-20s%-20s\n", "-o <directory>", "Directory for the files written");
+    printf("\tOptional arguments:\n");
+    printf("\t\t%-20s%-20s\n", "-h", "This help message");
+    printf("\t\t%-20s%-20s\n", "-r <adaptors.txt>", "Adaptors ending the reads, to also match both ends");
+    printf("\t\t%-20s%-20s %s %s\n", "-S <LIST>", "Benchmarks to run", "Default:", suites.c_str());
+    printf("\t\t%-20s%-20s %s %s\n", "-m <LIST>", "Mismatches for match and e2e", "Default:", mismatches.c_str());
+    printf("\t\t%-20s%-20s %s %s\n", "-t <LIST>", "Threads for e2e", "Default:", threads.c_str());
+    printf("\t\t%-20s%-20s %s %s\n", "-b <LIST>", "Read buffer sizes for e2e", "Default:", buffers.c_str());
+    printf("\t\t%-20s%-20s %s %s\n", "-s <PATH>", "sff_splitter to run for e2e", "Default:", splitter.c_str());
+    printf("\t\t%-20s%-20s %s %d\n", "-R <VALUE>", "Runs of each benchmark, the fastest is reported", "Default:", repeats);
+    printf("\t\t%-20s%-20s\n", "-H", "Do not print the header line");
+}
+
+void parse_arguments(int argc, char** argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "hi:a:r:o:S:m:t:b:s:R:H")) != EOF) {
+        switch(c) {
+            case 'h':
+                print_help_message();
+                exit(0);
+                break;
+            case 'i':
+                infilename = std::string(optarg);
+                break;
+            case 'a':
+                adaptorfilename = std::string(optarg);
+                break;
+            case 'r':
+                rightadaptorfilename = std::string(optarg);
+                break;
+            case 'o':
+                outdir = std::string(optarg);
+                break;
+            case 'S':
+                suites = std::string(optarg);
+                break;
+            case 'm':
+                mismatches = std::string(optarg);
+                break;
+            case 't':
+                threads = std::string(optarg);
+                break;
+            case 'b':
+                buffers = std::string(optarg);
+                break;
+            case 's':
+                splitter = std::string(optarg);
+                break;
+            case 'R':
+                repeats = atoi(optarg);
+                if (repeats < 1)
+                {
+                    std::cerr << "Number of runs must be at least 1" << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'H':
+                header = false;
+                break;
+            case '?':
+                print_help_message();
+                exit(1);
+                break;
+            default:
+                abort();
+        }
+    }
+    if (infilename.size() == 0 || adaptorfilename.size() == 0 ||
+        outdir.size() == 0)
+    {
+        std::cerr << "input, adaptor filename and directory are required" << std::endl;
+        print_help_message();
+        exit(1);
+    }
+}
+
+/* Comma separated list of numbers */
+std::vector<int> parse_list(const std::string &list)
+{
+    std::vector<int> values;
+    std::istringstream iss(list);
+    std::string value;
+    while (std::getline(iss, value, ','))
+        values.push_back(atoi(value.c_str()));
+    return values;
+}
+
+bool has_suite(const std::string &suite)
+{
+    std::istringstream iss(suites);
+    std::string name;
+    while (std::getline(iss, name, ','))
+        if (name == suite)
+            return true;
+    return false;
+}
+
+std::string basename(const std::string &filename)
+{
+    return filename.substr(filename.find_last_of('/') + 1);
+}
+
+/* Work done by one run of a benchmark */
+struct Result
+{
+    uint64_t reads;
+    uint64_t bytes;
+    double seconds;
+};
+
+void report(const std::string &benchmark, const std::string &parameters,
+            const Result &result)
+{
+    double seconds = result.seconds > 0 ? result.seconds : 1e-9;
+    printf("%s\t%s\t%s\t%llu\t%llu\t%.6f\t%.1f\t%.2f\n",
+           benchmark.c_str(), basename(infilename).c_str(),
+           parameters.c_str(), (unsigned long long)result.reads,
+           (unsigned long long)result.bytes, result.seconds,
+           result.reads / seconds, result.bytes / seconds / 1e6);
+    fflush(stdout);
+}
+
+/* Run fn repeats times, and report the fastest run */
+template <typename Function>
+void run(const std::string &benchmark, const std::string &parameters,
+         Function fn)
+{
+    Result best;
+    for (int r = 0; r < repeats; r++)
+    {
+        double start = sff::now();
+        Result result = fn();
+        result.seconds = sff::now() - start;
+        if (r == 0 || result.seconds < best.seconds)
+            best = result;
+    }
+    report(benchmark, parameters, best);
+}
+
+Result read_stream(bool raw)
+{
+    sff::SFFFileReader reader(infilename, raw);
+    sff::SFFFileHeader common_header;
+    if (!reader.read_common_header(common_header))
+    {
+        std::cerr << "Failed to read common header" << std::endl;
+        exit(2);
+    }
+    sff::SFFField field(common_header);
+    Result result = {0, 0, 0};
+    while (!reader.done())
+    {
+        if (!reader.read_field(field))
+        {
+            std::cerr << "Error reading field" << std::endl;
+            exit(2);
+        }
+        result.reads++;
+    }
+    result.bytes = reader.get_bytes_read();
+    return result;
+}
+
+Result read_mapped(bool decode)
+{
+    sff::SFFMappedReader reader(infilename, decode);
+    sff::SFFFileHeader common_header;
+    if (!reader.read_common_header(common_header))
+    {
+        std::cerr << "Failed to read common header" << std::endl;
+        exit(2);
+    }
+    sff::SFFField field(common_header);
+    Result result = {0, 0, 0};
+    while (!reader.done())
+    {
+        if (!reader.read_field(field))
+        {
+            std::cerr << "Error reading field" << std::endl;
+            exit(2);
+        }
+        result.reads++;
+    }
+    result.bytes = reader.get_bytes_read();
+    return result;
+}
+
+/* Every read of the input as a view into the map */
+void map_fields(sff::SFFMappedReader &reader, sff::SFFFileHeader &common_header,
+                std::vector<sff::SFFField*> &fields)
+{
+    if (!reader.read_common_header(common_header))
+    {
+        std::cerr << "Failed to read common header" << std::endl;
+        exit(2);
+    }
+    while (!reader.done())
+    {
+        sff::SFFField *field = new sff::SFFField(common_header);
+        if (!reader.read_field(*field))
+        {
+            std::cerr << "Error reading field" << std::endl;
+            exit(2);
+        }
+        fields.push_back(field);
+    }
+}
+
+void delete_fields(std::vector<sff::SFFField*> &fields)
+{
+    for (size_t f = 0; f < fields.size(); f++)
+        delete fields[f];
+    fields.clear();
+}
+
+void bench_match()
+{
+    sff::SFFMappedReader reader(infilename);
+    sff::SFFFileHeader common_header;
+    std::vector<sff::SFFField*> fields;
+    map_fields(reader, common_header, fields);
+
+    std::vector<int> ms = parse_list(mismatches);
+    const char *modes[] = {"levenshtein", "hamming"};
+    for (size_t m = 0; m < ms.size(); m++)
+    {
+        for (int mode = 0; mode < 2; mode++)
+        {
+            if (ms[m] == 0 && mode > 0)
+                continue;
+            /* With and without the neighborhood index, which 
+             * substitution-only matching does not use */
+            for (int indexed = 1; indexed >= 0; indexed--)
+            {
+                if ((ms[m] == 0 || mode > 0) && !indexed)
+                    continue;
+                sff::AdaptorFinder finder(ms[m],
+                        mode ? sff::HAMMING : sff::LEVENSHTEIN,
+                        indexed ? DEFAULT_NEIGHBORHOOD_CAP : 0);
+                finder.read(adaptorfilename);
+                char parameters[64];
+                snprintf(parameters, sizeof(parameters), "m=%d,%s%s",
+                         ms[m], modes[mode], indexed ? "" : ",noindex");
+                run("match", parameters, [&]() -> Result {
+                    Result result = {0, 0, 0};
+                    std::string match;
+                    for (size_t f = 0; f < fields.size(); f++)
+                    {
+                        finder.find(*fields[f], match);
+                        result.reads++;
+                    }
+                    return result;
+                });
+            }
+        }
+    }
+
+    /* Both ends, when the reads have an adaptor at each */
+    for (size_t m = 0; rightadaptorfilename.size() > 0 && m < ms.size(); m++)
+    {
+        sff::PairedAdaptorFinder finder(ms[m]);
+        finder.read(adaptorfilename, rightadaptorfilename);
+        char parameters[64];
+        snprintf(parameters, sizeof(parameters), "m=%d,levenshtein", ms[m]);
+        run("match_paired", parameters, [&]() -> Result {
+            Result result = {0, 0, 0};
+            std::string match;
+            for (size_t f = 0; f < fields.size(); f++)
+            {
+                finder.find(*fields[f], match);
+                result.reads++;
+            }
+            return result;
+        });
+    }
+
+    /* The aligners alone, on the read prefix of each adaptor */
+    std::vector<std::string> adaptors;
+    std::ifstream ifs(adaptorfilename.c_str());
+    std::string name, sequence;
+    while (ifs >> name >> sequence)
+        adaptors.push_back(sequence);
+    int maxscore = ms.empty() ? 2 : ms.back();
+    char parameters[64];
+    snprintf(parameters, sizeof(parameters), "m=%d,adaptors=%zu",
+             maxscore, adaptors.size());
+    /* Bounded to the same number of alignments whatever the number of
+     * adaptors */
+    size_t nfields = std::min(fields.size(),
+                              (size_t)10000000 / std::max((size_t)1, adaptors.size()));
+    run("align_dp", parameters, [&]() -> Result {
+        Result result = {0, 0, 0};
+        std::string prefix;
+        for (size_t f = 0; f < nfields; f++)
+        {
+            for (size_t a = 0; a < adaptors.size(); a++)
+            {
+                prefix = fields[f]->get_left_adaptor_sequence(adaptors[a].size());
+                sff::AdaptorAligner aligner(adaptors[a], prefix);
+                aligner.compute_alignment_score(maxscore);
+            }
+            result.reads++;
+        }
+        return result;
+    });
+    std::vector<sff::BitParallelAligner> aligners;
+    for (size_t a = 0; a < adaptors.size(); a++)
+        if (sff::BitParallelAligner::supports(adaptors[a]))
+            aligners.push_back(sff::BitParallelAligner(adaptors[a]));
+    run("align_bitparallel", parameters, [&]() -> Result {
+        Result result = {0, 0, 0};
+        for (size_t f = 0; f < nfields; f++)
+        {
+            for (size_t a = 0; a < aligners.size(); a++)
+            {
+                const char *bases;
+                int len = fields[f]->get_left_adaptor_bases(adaptors[a].size(), &bases);
+                aligners[a].compute_alignment_score(bases, len, maxscore);
+            }
+            result.reads++;
+        }
+        return result;
+    });
+    delete_fields(fields);
+}
+
+void bench_write()
+{
+    sff::SFFMappedReader reader(infilename);
+    sff::SFFFileHeader common_header;
+    std::vector<sff::SFFField*> fields;
+    map_fields(reader, common_header, fields);
+    std::string outfilename = outdir + "/bench_write.sff";
+
+    /* Views are copied as is */
+    run("write_raw", "", [&]() -> Result {
+        sff::SFFFileWriter writer(outfilename);
+        writer.write_common_header(common_header);
+        for (size_t f = 0; f < fields.size(); f++)
+            writer.write_field(*fields[f]);
+        writer.write_index();
+        writer.write_common_header(common_header);
+        writer.flush();
+        Result result = {(uint64_t)writer.get_number_of_fields_written(),
+                         writer.get_bytes_written(), 0};
+        return result;
+    });
+
+    /* Decoded reads are encoded, a sample is cycled through so that
+     * the reads stay in memory */
+    size_t nsample = std::min(fields.size(), (size_t)ENCODE_SAMPLE);
+    for (size_t f = 0; f < nsample; f++)
+        fields[f]->decode_view();
+    run("write_encode", "", [&]() -> Result {
+        sff::SFFFileWriter writer(outfilename);
+        writer.write_common_header(common_header);
+        for (size_t f = 0; f < fields.size(); f++)
+            writer.write_field(*fields[f % nsample]);
+        writer.flush();
+        Result result = {(uint64_t)writer.get_number_of_fields_written(),
+                         writer.get_bytes_written(), 0};
+        return result;
+    });
+    delete_fields(fields);
+    remove(outfilename.c_str());
+}
+
+void bench_e2e()
+{
+    struct stat st;
+    uint64_t bytes = (stat(infilename.c_str(), &st) == 0) ? st.st_size : 0;
+    std::vector<int> ts = parse_list(threads);
+    std::vector<int> bs = parse_list(buffers);
+    std::vector<int> ms = parse_list(mismatches);
+    int m = ms.empty() ? 0 : ms.back();
+    sff::SFFFileReader reader(infilename);
+    sff::SFFFileHeader common_header;
+    if (!reader.read_common_header(common_header))
+    {
+        std::cerr << "Failed to read common header" << std::endl;
+        exit(2);
+    }
+    for (size_t t = 0; t < ts.size(); t++)
+    {
+        for (size_t b = 0; b < bs.size(); b++)
+        {
+            for (int mmap = 0; mmap < 2; mmap++)
+            {
+                char parameters[64];
+                snprintf(parameters, sizeof(parameters), "t=%d,b=%d,m=%d%s",
+                         ts[t], bs[b], m, mmap ? ",mmap" : "");
+                std::ostringstream command;
+                command << splitter << " -i " << infilename
+                        << " -a " << adaptorfilename
+                        << " -o " << outdir << "/bench_e2e"
+                        << " -t " << ts[t] << " -b " << bs[b] << " -m " << m
+                        << (mmap ? " -p" : "");
+                run("e2e", parameters, [&]() -> Result {
+                    if (system(command.str().c_str()) != 0)
+                    {
+                        std::cerr << "Failed: " << command.str() << std::endl;
+                        exit(2);
+                    }
+                    Result result = {common_header.nreads, bytes, 0};
+                    return result;
+                });
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    parse_arguments(argc, argv);
+    if (header)
+        printf("#benchmark\tinput\tparameters\treads\tbytes\tseconds\treads_per_second\tmb_per_second\n");
+    if (has_suite("read"))
+    {
+        run("read_stream", "decode", []() { return read_stream(false); });
+        run("read_stream", "raw", []() { return read_stream(true); });
+        run("read_mapped", "view", []() { return read_mapped(false); });
+        run("read_mapped", "decode", []() { return read_mapped(true); });
+    }
+    if (has_suite("match"))
+        bench_match();
+    if (has_suite("write"))
+        bench_write();
+    if (has_suite("e2e"))
+        bench_e2e();
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <iostream>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include "sff.hpp"
+
+#define PRG_NAME "sff_dump"
+
+/* Prints the reads of SFF files, to check the outputs of sff_splitter
+ * with text tools (make check). One line per read, with tab separated
+ * columns: name, bases, qualities (Phred+33), clip_qual_left,
+ * clip_qual_right, clip_adapter_left and clip_adapter_right. Inputs
+ * may be compressed, or standard input ("-").
+ */
+
+void print_help_message()
+{
+    printf("Usage: %s %s\n", PRG_NAME, "<input.sff>...");
+}
+
+void dump(const std::string &filename)
+{
+    sff::SFFFileReader reader(filename);
+    sff::SFFFileHeader common_header;
+    if (!reader.read_common_header(common_header))
+    {
+        std::cerr << "Failed to read common header of " << filename << std::endl;
+        exit(2);
+    }
+    sff::SFFField field(common_header);
+    std::string line;
+    while (!reader.done())
+    {
+        if (!reader.read_field(field))
+        {
+            std::cerr << "Error reading field" << std::endl;
+            exit(2);
+        }
+        const sff::SFFReadView &view = field.get_view();
+        line.assign(view.name, view.name_len);
+        line += '\t';
+        line.append(view.bases, view.nbases);
+        line += '\t';
+        for (uint32_t b = 0; b < view.nbases; b++)
+            line += (char)(view.quality[b] + 33);
+        char clips[64];
+        snprintf(clips, sizeof(clips), "\t%u\t%u\t%u\t%u\n",
+                 view.clip_qual_left, view.clip_qual_right,
+                 view.clip_adapter_left, view.clip_adapter_right);
+        line += clips;
+        fwrite(line.data(), 1, line.size(), stdout);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || std::string(argv[1]) == "-h")
+    {
+        print_help_message();
+        exit(argc < 2 ? 1 : 0);
+    }
+    for (int i = 1; i < argc; i++)
+        dump(argv[i]);
+    return 0;
+}
@@ -0,0 +1,439 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <ctype.h>
+#include "sff.hpp"
+
+#define PRG_NAME "sff_generate"
+
+/* Deterministic synthetic SFF files, to benchmark sff_splitter on
+ * inputs that can be regenerated anywhere. A read is the key, one of
+ * the barcodes and a random insert, with sequencing errors, turned
+ * into the flowgram a sequencer would have produced with the flow
+ * order of the file. The first base after the barcode is the left
+ * quality clip, as sff_splitter expects. With right barcodes, reads
+ * also end with one of them, and are not clipped on the right.
+ * With -R, the reads are given instead: fixed inputs with known
+ * answers, for make check.
+ */
+
+/* Required arguments */
+std::string outfilename;
+std::string adaptorfilename;
+std::string rightadaptorfilename;  // Optional, for dual-end barcodes
+std::string readsfilename;         // Reads to write instead of random ones
+
+/* Options */
+int nreads=100000;
+int flow_len=400;
+int min_length=100;
+int max_length=400;
+int nbarcodes=0;      // Generate this many barcodes, else read them
+int barcode_length=10;
+double error_rate=0.01;
+double unmatched_rate=0.05;
+unsigned long seed=1;
+std::string key("TCAG");
+
+/* The random engine is fully specified by the standard, unlike the
+ * distributions, so only its raw output is used: the same seed gives
+ * the same file with any compiler */
+std::mt19937 rng;
+
+uint32_t uniform(uint32_t n)
+{
+    return rng() % n;
+}
+
+double unit()
+{
+    return rng() / 4294967296.0;
+}
+
+char random_base()
+{
+    return "ACGT"[uniform(4)];
+}
+
+void print_help_message()
+{
+    printf("Usage: %s %s\n", PRG_NAME, "[arguments]");
+    printf("\tRequired arguments:\n");
+    printf("\t\t%-20s%-20s\n", "-o <output.sff>", "File to generate");
+    printf("\t\t%-20s%-20s %s\n", "-a <adaptors.txt>", "Barcodes, as given to sff_splitter.",
+                    "Written with -B, read otherwise");
+    printf("\t\t%-20s%-20s %s\n", "-A <adaptors.txt>", "Barcodes ending the reads, as given to sff_splitter -r.",
+                    "Written with -B, read otherwise. Default: none");
+    printf("\t\t%-20s%-20s\n", "-R <reads.txt>", "Instead of random reads, write these ones: '<name> <barcode> <insert> [<right barcode>]' per line, left clipped after the barcode. Replaces -a and -A");
+    printf("\tOptional arguments:\n");
+    printf("\t\t%-20s%-20s\n", "-h", "This help message");
+    printf("\t\t%-20s%-20s %s %d\n", "-n <VALUE>", "Number of reads", "Default:", nreads);
+    printf("\t\t%-20s%-20s %s %d\n", "-f <VALUE>", "Number of flows", "Default:", flow_len);
+    printf("\t\t%-20s%-20s %s %d\n", "-l <VALUE>", "Minimum read length, before the flows run out", "Default:", min_length);
+    printf("\t\t%-20s%-20s %s %d\n", "-r <VALUE>", "Maximum read length", "Default:", max_length);
+    printf("\t\t%-20s%-20s\n", "-B <VALUE>", "Generate this many barcodes, and write them to the adaptor file");
+    printf("\t\t%-20s%-20s %s %d\n", "-L <VALUE>", "Length of generated barcodes", "Default:", barcode_length);
+    printf("\t\t%-20s%-20s %s %g\n", "-e <VALUE>", "Sequencing errors per base (substitutions, insertions, deletions)", "Default:", error_rate);
+    printf("\t\t%-20s%-20s %s %g\n", "-u <VALUE>", "Fraction of reads without a barcode", "Default:", unmatched_rate);
+    printf("\t\t%-20s%-20s %s %lu\n", "-s <VALUE>", "Random seed", "Default:", seed);
+    printf("\t\t%-20s%-20s %s %s\n", "-k <KEY>", "Key sequence", "Default:", key.c_str());
+}
+
+void parse_arguments(int argc, char** argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "ho:a:A:R:n:f:l:r:B:L:e:u:s:k:")) != EOF) {
+        switch(c) {
+            case 'h':
+                print_help_message();
+                exit(0);
+                break;
+            case 'o':
+                outfilename = std::string(optarg);
+                break;
+            case 'a':
+                adaptorfilename = std::string(optarg);
+                break;
+            case 'A':
+                rightadaptorfilename = std::string(optarg);
+                break;
+            case 'R':
+                readsfilename = std::string(optarg);
+                break;
+            case 'n':
+                nreads = atoi(optarg);
+                break;
+            case 'f':
+                flow_len = atoi(optarg);
+                break;
+            case 'l':
+                min_length = atoi(optarg);
+                break;
+            case 'r':
+                max_length = atoi(optarg);
+                break;
+            case 'B':
+                nbarcodes = atoi(optarg);
+                break;
+            case 'L':
+                barcode_length = atoi(optarg);
+                break;
+            case 'e':
+                error_rate = atof(optarg);
+                break;
+            case 'u':
+                unmatched_rate = atof(optarg);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                key = std::string(optarg);
+                break;
+            case '?':
+                print_help_message();
+                exit(1);
+                break;
+            default:
+                abort();
+        }
+    }
+    if (outfilename.size() == 0 ||
+        (adaptorfilename.size() == 0 && readsfilename.size() == 0))
+    {
+        std::cerr << "output and adaptor (or reads) filenames are required" << std::endl;
+        print_help_message();
+        exit(1);
+    }
+    if (nreads < 0 || flow_len < 4 || min_length < 1 ||
+        max_length < min_length || nbarcodes < 0 || barcode_length < 1 ||
+        error_rate < 0 || error_rate >= 1 ||
+        unmatched_rate < 0 || unmatched_rate > 1)
+    {
+        std::cerr << "invalid argument value" << std::endl;
+        exit(1);
+    }
+}
+
+int hamming_distance(const std::string &a, const std::string &b)
+{
+    int distance = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        distance += (a[i] != b[i]);
+    return distance;
+}
+
+/* Random barcodes, at least 3 substitutions apart when possible so
+ * that single errors stay attributable, like real barcode sets */
+void generate_barcodes(const std::string &filename, const char *prefix,
+                       std::vector<std::string> &names,
+                       std::vector<std::string> &barcodes)
+{
+    for (int b = 0; b < nbarcodes; b++)
+    {
+        std::string barcode;
+        for (int attempt = 0; ; attempt++)
+        {
+            barcode.clear();
+            for (int i = 0; i < barcode_length; i++)
+                barcode += random_base();
+            int closest = barcode_length;
+            for (size_t o = 0; o < barcodes.size(); o++)
+                closest = std::min(closest, hamming_distance(barcode, barcodes[o]));
+            if (closest >= 3 || (attempt >= 1000 && closest > 0))
+                break;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%s%04d", prefix, b + 1);
+        names.push_back(name);
+        barcodes.push_back(barcode);
+    }
+    std::ofstream ofs(filename.c_str());
+    for (size_t b = 0; b < barcodes.size(); b++)
+        ofs << names[b] << "\t" << barcodes[b] << std::endl;
+    if (!ofs)
+    {
+        std::cerr << "Could not write adaptor file" << std::endl;
+        exit(2);
+    }
+}
+
+void read_barcodes(const std::string &filename,
+                   std::vector<std::string> &names,
+                   std::vector<std::string> &barcodes)
+{
+    std::ifstream ifs(filename.c_str());
+    if (!ifs.is_open())
+    {
+        std::cerr << "Could not open adaptor file for reading" << std::endl;
+        exit(1);
+    }
+    std::string name, sequence;
+    while (ifs >> name >> sequence)
+    {
+        names.push_back(name);
+        barcodes.push_back(sequence);
+    }
+}
+
+/* A read of the -R file: the key is prepended to bases, and the left
+ * clip set barcode_length bases past it */
+struct GivenRead
+{
+    std::string name;
+    std::string bases;
+    int barcode_length;
+};
+
+void read_given_reads(const std::string &filename,
+                      std::vector<GivenRead> &reads)
+{
+    std::ifstream ifs(filename.c_str());
+    if (!ifs.is_open())
+    {
+        std::cerr << "Could not open reads file for reading" << std::endl;
+        exit(1);
+    }
+    std::string line;
+    while (std::getline(ifs, line))
+    {
+        std::istringstream fields(line);
+        std::string barcode, insert, right;
+        GivenRead read;
+        if (!(fields >> read.name))
+            continue;
+        if (!(fields >> barcode >> insert))
+        {
+            std::cerr << "Reads need a name, a barcode and an insert" << std::endl;
+            exit(1);
+        }
+        fields >> right;
+        read.bases = barcode + insert + right;
+        read.barcode_length = barcode.size();
+        reads.push_back(read);
+    }
+}
+
+/* Copy sequence to out with errors at error_rate per base */
+void add_errors(const std::string &sequence, std::string &out)
+{
+    for (size_t i = 0; i < sequence.size(); i++)
+    {
+        if (unit() >= error_rate)
+        {
+            out += sequence[i];
+            continue;
+        }
+        switch (uniform(3))
+        {
+            case 0:  // Substitution
+                out += "ACGT"[(std::string("ACGT").find(sequence[i]) + 1 +
+                               uniform(3)) % 4];
+                break;
+            case 1:  // Insertion
+                out += random_base();
+                out += sequence[i];
+                break;
+            default: // Deletion
+                break;
+        }
+    }
+}
+
+/* Nucleotide a flow incorporates for a base call: lowercase calls
+ * are flowed as uppercase ones, and uncalled or ambiguous ones (N,
+ * IUPAC codes) as A */
+char flowed_base(char base)
+{
+    base = toupper(base);
+    return strchr("ACGT", base) != NULL ? base : 'A';
+}
+
+/* Flowgram of bases with the flow order of header: each flow is the
+ * length of the homopolymer it incorporates, in hundredths, with
+ * some noise. Bases are kept as called. Bases past the last flow are
+ * dropped */
+void flow_bases(const sff::SFFFileHeader &header, const std::string &bases,
+                sff::SFFReadHeader *readHeader, sff::SFFReadData *data)
+{
+    std::vector<uint16_t> flowgram(header.flow_len);
+    std::vector<uint8_t> flow_index;
+    size_t pos = 0;
+    int last_flow = 0;
+    for (int f = 0; f < header.flow_len; f++)
+    {
+        int run = 0;
+        while (pos < bases.size() && flowed_base(bases[pos]) == header.flow[f])
+        {
+            /* Flows since the previous incorporation, 1-based */
+            flow_index.push_back(run == 0 ? f + 1 - last_flow : 0);
+            run++;
+            pos++;
+        }
+        if (run > 0)
+            last_flow = f + 1;
+        int signal = run * 100 + (int)uniform(31) - 15;
+        flowgram[f] = std::max(0, signal);
+    }
+    data->resize(header.flow_len, pos);
+    data->flowgram = flowgram;
+    data->flow_index = flow_index;
+    data->bases.assign(bases.begin(), bases.begin() + pos);
+    for (size_t i = 0; i < pos; i++)
+        data->quality[i] = 20 + uniform(21);
+    readHeader->nbases = pos;
+}
+
+int main(int argc, char** argv)
+{
+    parse_arguments(argc, argv);
+    rng.seed(seed);
+
+    std::vector<std::string> names, barcodes;
+    std::vector<std::string> rightnames, rightbarcodes;
+    std::vector<GivenRead> given;
+    if (readsfilename.size() > 0)
+    {
+        read_given_reads(readsfilename, given);
+        nreads = given.size();
+    }
+    else if (nbarcodes > 0)
+        generate_barcodes(adaptorfilename, "BC", names, barcodes);
+    else
+        read_barcodes(adaptorfilename, names, barcodes);
+    if (rightadaptorfilename.size() > 0 && nbarcodes > 0)
+        generate_barcodes(rightadaptorfilename, "BR", rightnames, rightbarcodes);
+    else if (rightadaptorfilename.size() > 0)
+        read_barcodes(rightadaptorfilename, rightnames, rightbarcodes);
+    if (given.empty() && (barcodes.empty() ||
+        (rightadaptorfilename.size() > 0 && rightbarcodes.empty())))
+    {
+        std::cerr << "no barcodes" << std::endl;
+        exit(1);
+    }
+
+    sff::SFFFileHeader header;
+    header.magic = SFF_MAGIC;
+    memcpy(header.version, SFF_VERSION, SFF_VERSION_LENGTH);
+    header.index_offset = 0;
+    header.index_len = 0;
+    header.nreads = nreads;
+    header.key_len = key.size();
+    header.flow_len = flow_len;
+    header.flowgram_format = 1;
+    for (int f = 0; f < flow_len; f++)
+        header.flow.push_back("TACG"[f % 4]);
+    header.key.assign(key.begin(), key.end());
+    header.header_len = (header.get_size() + PADDING_SIZE - 1) /
+                        PADDING_SIZE * PADDING_SIZE;
+
+    sff::SFFFileWriter writer(outfilename);
+    writer.write_common_header(header);
+    sff::SFFField field(header);
+    std::string bases, insert;
+    for (int r = 0; r < nreads; r++)
+    {
+        sff::SFFReadHeader *readHeader = field.get_header_storage();
+        sff::SFFReadData *data = field.get_data_storage();
+        char name[32];
+        snprintf(name, sizeof(name), "SYN%08d", r);
+        readHeader->name = given.empty() ? std::string(name) : given[r].name;
+        readHeader->name_len = readHeader->name.size();
+        readHeader->header_len = (readHeader->get_size() + PADDING_SIZE - 1) /
+                                 PADDING_SIZE * PADDING_SIZE;
+
+        uint16_t clip_left;
+        bases = key;
+        if (!given.empty())
+        {
+            clip_left = bases.size() + given[r].barcode_length + 1;
+            bases += given[r].bases;
+        }
+        else
+        {
+            /* Barcode, or as many random bases for unmatched reads */
+            const std::string &barcode = barcodes[uniform(barcodes.size())];
+            if (unit() < unmatched_rate)
+                for (size_t i = 0; i < barcode.size(); i++)
+                    bases += random_base();
+            else
+                add_errors(barcode, bases);
+            clip_left = bases.size() + 1;
+            int length = min_length + uniform(max_length - min_length + 1);
+            insert.clear();
+            for (int i = 0; i < length; i++)
+                insert += random_base();
+            add_errors(insert, bases);
+            if (!rightbarcodes.empty())
+                add_errors(rightbarcodes[uniform(rightbarcodes.size())], bases);
+        }
+
+        flow_bases(header, bases, readHeader, data);
+        readHeader->clip_qual_left = std::min((uint32_t)clip_left,
+                                              readHeader->nbases);
+        readHeader->clip_qual_right = readHeader->nbases;
+        readHeader->clip_adapter_left = 0;
+        readHeader->clip_adapter_right = 0;
+        field.set_header(readHeader);
+        field.set_data(data);
+        if (!writer.write_field(field))
+        {
+            std::cerr << "Could not write field to disk" << std::endl;
+            exit(2);
+        }
+    }
+    if (!writer.write_index() || !writer.write_common_header(header))
+    {
+        std::cerr << "Could not write field to disk" << std::endl;
+        exit(2);
+    }
+    return 0;
+}
@@ -1,55 +1,192 @@
-#include <omp.h>
 #include <iostream>
 #include <string>
 #include <iomanip>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
 #include <getopt.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include "sff.hpp"
 #include "adaptors.hpp"
+#include "pipeline.hpp"
+#include "bswap.hpp"
+#include "stats.hpp"
 
 #define PRG_NAME "sff_splitter"
 
 /* Required arguments */
-std::string infilename; 
+std::vector<std::string> infilenames; 
 std::string outstem; 
 std::string adaptorfilename;
+/* Adaptors at the right end of the reads, with those of adaptorfilename
+ * at the left end */
+std::string rightadaptorfilename;
+/* Lookup mode, replaces the adaptor file */
+std::string namesfilename;
+/* Inputs listed in a file, with their output stems */
+std::string manifestfilename;
+/* Report of the run, in JSON */
+std::string reportfilename;
+/* Extraction mode, adaptors to copy out of a container */
+std::vector<std::string> extractadaptors;
 
 /* Options */
 int maxmismatch=0;
 bool verbose=false;
+bool use_mmap=false;
+bool decode_reads=false;
 int num_threads=1;
 int buffer_size=100; 
+int write_buffer_mb=DEFAULT_WRITE_BUFFER_SIZE/(1024*1024); 
+bool background_flush=false; 
+int compress_level=0; 
+bool merge_outputs=false; 
+bool unordered=false; 
+bool container_output=false; 
+std::string output_format("sff");  // sff, fastq or fasta
+bool strip_adaptors=false; 
+bool clip_adaptors=false; 
+int max_open_outputs=0;  // 0 for as many as the file limit allows
+size_t neighborhood_cap=DEFAULT_NEIGHBORHOOD_CAP; 
+sff::DistanceMode distance_mode=sff::LEVENSHTEIN; 
 
-/* Map from adaptor name to writer */
-typedef std::unordered_map<std::string, sff::SFFFileWriter*> outmap; 
+/* Files written for one adaptor: an SFF file, or the sequences in 
+ * FASTQ, or in FASTA with their qualities in QUAL */
+struct AdaptorOutput
+{
+    sff::SFFFileWriter *reads; 
+    sff::SequenceFileWriter *sequences; 
+    sff::SequenceFileWriter *qualities; 
+};
+/* Map from adaptor name to writers */
+typedef std::unordered_map<std::string, AdaptorOutput> outmap; 
 typedef std::vector<sff::SFFField*> fieldbuffer; 
 typedef std::vector<sff::SFFField*>::iterator bufferiter; 
 
+/* One input file, and what the pipeline learns about it. The reader
+ * is kept open until the end of the run, since fields may be views
+ * into it. */
+struct SFFInput
+{
+    std::string filename; 
+    std::string stem;       // Output stem, unless outputs are merged
+    sff::VirtualSFFReader *reader; 
+    sff::SFFFileHeader common_header; 
+    int cpt;                // Count number of reads
+    int notfound;           // Count number of reads that were not found
+    uint64_t bytes;         // Bytes read, decompressed
+    outmap outputs;         // Unless outputs are merged
+    sff::SFFContainerWriter *container;  // With -C, unless merged
+};
+
+/* What was written to one output, for the run report */
+struct OutputReport
+{
+    std::string filename; 
+    std::string adaptor; 
+    int nreads; 
+    uint64_t bytes; 
+    double write_seconds; 
+    double compress_seconds; 
+};
+
+/* Timers and counters of every stage, each thread filling its own */
+struct RunStats
+{
+    sff::StageStats read; 
+    std::vector<sff::StageStats> match;     // One per matcher thread
+    std::vector<sff::MatchStats> matching;  // One per matcher thread
+    sff::StageStats write; 
+    std::vector<OutputReport> outputs; 
+    uint64_t output_releases;  // Outputs closed to open others
+};
+
+/* Reads of a batch matched to one adaptor, in batch order */
+struct AdaptorGroup
+{
+    std::string name; 
+    std::vector<int> reads; 
+};
+
+/* Unit of work passed between the pipeline stages. id is the position
+ * of the batch in the run, inputs being read one after the other, and
+ * lets the writer restore input order. input is the index of the file
+ * the batch comes from, and bytes the size of its reads in that file.
+ * Batches and their fields are allocated once and recycled through a
+ * pool, so reads do not allocate once the pipeline is warm.
+ * With a mapped input, the reader only finds where the reads of a 
+ * batch start (chunk) and matchers parse them into fields.
+ * Matchers also group the reads by adaptor (the first ngroups of 
+ * groups), so that the writer looks each output up once per batch.
+ */
+struct FieldBatch
+{
+    size_t id; 
+    size_t input; 
+    int len; 
+    uint64_t bytes; 
+    sff::SFFMappedReader *mapped; 
+    const char *chunk; 
+    fieldbuffer fields; 
+    std::vector<std::string> matches; 
+    std::vector<sff::AdaptorSpan> spans; 
+    std::vector<AdaptorGroup> groups; 
+    size_t ngroups; 
+};
+typedef sff::BoundedQueue<FieldBatch*> batchqueue; 
+
 void print_help_message()
 {
     printf("Usage: %s %s\n", PRG_NAME, "[arguments]");
     printf("\tRequired arguments:\n");
-    printf("\t\t%-20s%-20s\n", "-i <input.sff>", "Input file to split.");
+    printf("\t\t%-20s%-20s %s\n", "-i <input.sff>", "Input file to split. Can be repeated.",
+                    "'-' for standard input. May be gzip (or zstd) compressed, unless using -p or -n");
+    printf("\t\t%-20s%-20s %s\n", "-l <inputs.txt>", "Input files to split, one per line, each optionally followed by its output stem.",
+                    "Replaces or adds to -i");
     printf("\t\t%-20s%-20s %s\n", 
                     "-a <adaptors.txt>", 
                     "Adaptors used to split input file.",
                     "Format: <name>\t<sequence>.");
+    printf("\t\t%-20s%-20s %s\n", 
+                    "-r <adaptors.txt>", 
+                    "Adaptors at the right end of the reads, as read from left to right, with -a at the left end.",
+                    "Reads matching both go to '<output_stem>.left+right.sff'");
     printf("\t\t%-20s%-20s %s\n",
                     "-o <output_stem>",
                     "Stem for output file.",
-                    "Output will be stored as '<output_stem>.adaptor.sff'");
+                    "Output will be stored as '<output_stem>.adaptor.sff', or '<output_stem>.input.adaptor.sff' with several inputs");
+    printf("\t\t%-20s%-20s %s\n",
+                    "-n <names.txt>",
+                    "Instead of splitting, extract the reads named in this file to '<output_stem>.sff'.",
+                    "Replaces -a. Uses the input index, or builds one and caches it in '<input.sff>.idx'");
+    printf("\t\t%-20s%-20s %s\n",
+                    "-e <adaptor>",
+                    "Instead of splitting, copy the reads of this adaptor out of a container written with -C to '<output_stem>.adaptor.sff'. Can be repeated.",
+                    "Replaces -a");
 
     printf("\tOptional arguments:\n");
     printf("\t\t%-20s%-20s\n", "-h", "This help message");
     printf("\t\t%-20s%-20s\n", "-v", "verbose");
+    printf("\t\t%-20s%-20s\n", "-p", "Parse input in place through a memory map");
+    printf("\t\t%-20s%-20s\n", "-D", "Decode and re-encode reads instead of copying them as is");
     printf("\t\t%-20s%-20s %s %d\n", 
                     "-m <VALUE>", 
                     "Maximum number of mismatches between adaptor and read.",
                     "Default:",
                     maxmismatch);
+    printf("\t\t%-20s%-20s %s %s\n", 
+                    "-M <MODE>", 
+                    "Mismatch model: 'levenshtein' or 'hamming' (substitutions only).",
+                    "Default:",
+                    "levenshtein");
     printf("\t\t%-20s%-20s %s %d\n", 
                     "-t <VALUE>", 
-                    "Number of threads",
+                    "Number of matcher threads",
                     "Default:",
                     num_threads);
     printf("\t\t%-20s%-20s %s %d\n", 
@@ -57,12 +194,70 @@ void print_help_message()
                     "Read buffer size",
                     "Default:",
                     buffer_size);
+    printf("\t\t%-20s%-20s %s %zu\n", 
+                    "-x <VALUE>", 
+                    "Maximum number of precomputed mismatch neighbours, 0 to always align",
+                    "Default:",
+                    neighborhood_cap);
+    printf("\t\t%-20s%-20s %s %d\n", 
+                    "-w <VALUE>", 
+                    "Output buffer size per file, in MB",
+                    "Default:",
+                    write_buffer_mb);
+    printf("\t\t%-20s%-20s\n", "-F", "Write output buffers to disk on a background thread");
+    printf("\t\t%-20s%-20s\n", "-G", "With several inputs, merge their reads into '<output_stem>.adaptor.sff'");
+    printf("\t\t%-20s%-20s %s\n", 
+                    "-C", 
+                    "Write the reads of every adaptor to a single container, '<output_stem>.sff', indexed by adaptor.",
+                    "Adaptors are copied out with -e");
+    printf("\t\t%-20s%-20s %s\n", 
+                    "-O <VALUE>", 
+                    "Maximum number of output files open at once, others are closed and reopened as needed.",
+                    "Default: from the open file limit (ulimit -n)");
+    printf("\t\t%-20s%-20s\n", "-U, --unordered", "Write batches as soon as they are matched. Reads of an output are no longer in input order");
+    printf("\t\t%-20s%-20s %s\n", 
+                    "-z <LEVEL>", 
+                    "Write outputs as BGZF (blocked gzip) files named '.sff.gz', compressed at this level (1-9) on -t threads.",
+                    "Default: uncompressed");
+    printf("\t\t%-20s%-20s\n", "-j <report.json>", "Write timings and counters of the run to this file, as JSON");
+    printf("\t\t%-20s%-20s %s\n", 
+                    "-f <FORMAT>", 
+                    "Output format: 'sff', 'fastq', or 'fasta' (with a '.qual' file). FASTQ and FASTA hold the bases within the clips.",
+                    "Default: sff");
+    printf("\t\t%-20s%-20s\n", "-s", "With FASTQ or FASTA, also leave out the bases of the adaptors matched");
+    printf("\t\t%-20s%-20s\n", "-c", "Set the adaptor clips of the reads written to the ends of the adaptors matched");
+}
+
+/* Inputs memory mapped (-p) or looked up by name (-n, -e) are read at
+ * random offsets, which standard input and compressed files, read as
+ * streams, do not allow */
+void check_seekable_input(const std::string &filename)
+{
+    struct stat st; 
+    if (filename == "-")
+    {
+        std::cerr << "standard input cannot be memory mapped (-p) "
+                  << "nor looked up by name (-n)" << std::endl;
+        exit(1); 
+    }
+    if (stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode) && 
+        !sff::is_plain_file(filename))
+    {
+        std::cerr << filename << ": compressed input cannot be memory "
+                  << "mapped (-p) nor looked up by name (-n)" << std::endl;
+        exit(1); 
+    }
 }
 
 void parse_arguments(int argc, char** argv)
 {
+    static struct option long_options[] = {
+        {"unordered", no_argument, NULL, 'U'}, 
+        {NULL, 0, NULL, 0}
+    }; 
     int c;
-    while ((c = getopt(argc, argv, "hvi:a:o:pm:t:b:")) != EOF) {
+    while ((c = getopt_long(argc, argv, "hvi:l:a:r:n:e:o:pDm:M:t:b:x:w:FGCUO:z:j:f:sc", 
+                            long_options, NULL)) != EOF) {
         switch(c) {
             case 'h':
                 print_help_message(); 
@@ -71,12 +266,30 @@ void parse_arguments(int argc, char** argv)
             case 'v':
                 verbose=true;
                 break;
+            case 'p':
+                use_mmap=true;
+                break;
+            case 'D':
+                decode_reads=true;
+                break;
             case 'i':
-                infilename = std::string(optarg);
+                infilenames.push_back(std::string(optarg));
+                break;
+            case 'l':
+                manifestfilename = std::string(optarg);
                 break;
             case 'a': 
                 adaptorfilename = std::string(optarg);
                 break;
+            case 'r': 
+                rightadaptorfilename = std::string(optarg);
+                break;
+            case 'n':
+                namesfilename = std::string(optarg);
+                break;
+            case 'e':
+                extractadaptors.push_back(std::string(optarg));
+                break;
             case 'o':
                 outstem = std::string(optarg); 
                 break;
@@ -89,6 +302,18 @@ void parse_arguments(int argc, char** argv)
                     exit(1); 
                 }
                 break;
+            case 'M':
+                if (std::string(optarg) == "levenshtein")
+                    distance_mode = sff::LEVENSHTEIN; 
+                else if (std::string(optarg) == "hamming")
+                    distance_mode = sff::HAMMING; 
+                else
+                {
+                    std::cerr << "Mismatch model must be "
+                              << "'levenshtein' or 'hamming'" << std::endl;
+                    exit(1); 
+                }
+                break;
             case 't':
                 num_threads = atoi(optarg); 
                 if (num_threads < 1)
@@ -105,6 +330,69 @@ void parse_arguments(int argc, char** argv)
                     exit(1); 
                 }
                 break;
+            case 'x':
+                if (atol(optarg) < 0)
+                {
+                    std::cerr << "Neighborhood cap must be 0 or greater" << std::endl;
+                    exit(1); 
+                }
+                neighborhood_cap = atol(optarg); 
+                break;
+            case 'w':
+                write_buffer_mb = atoi(optarg); 
+                if (write_buffer_mb < 1)
+                {
+                    std::cerr << "Output buffer size must be at least 1 MB" << std::endl;
+                    exit(1); 
+                }
+                break;
+            case 'F':
+                background_flush=true;
+                break;
+            case 'G':
+                merge_outputs=true;
+                break;
+            case 'C':
+                container_output=true;
+                break;
+            case 'U':
+                unordered=true;
+                break;
+            case 'O':
+                max_open_outputs = atoi(optarg); 
+                if (max_open_outputs < 1)
+                {
+                    std::cerr << "Maximum number of open outputs must be at least 1" << std::endl;
+                    exit(1); 
+                }
+                break;
+            case 'j':
+                reportfilename = std::string(optarg); 
+                break;
+            case 'f':
+                output_format = std::string(optarg); 
+                if (output_format != "sff" && output_format != "fastq" && 
+                    output_format != "fasta")
+                {
+                    std::cerr << "Output format must be "
+                              << "'sff', 'fastq' or 'fasta'" << std::endl;
+                    exit(1); 
+                }
+                break;
+            case 's':
+                strip_adaptors=true;
+                break;
+            case 'c':
+                clip_adaptors=true;
+                break;
+            case 'z':
+                compress_level = atoi(optarg); 
+                if (compress_level < 1 || compress_level > 9)
+                {
+                    std::cerr << "Compression level must be between 1 and 9" << std::endl;
+                    exit(1); 
+                }
+                break;
             case '?':
                 print_help_message(); 
                 exit(1); 
@@ -113,7 +401,7 @@ void parse_arguments(int argc, char** argv)
                 abort(); 
         }
     }
-    if (infilename.size() == 0) 
+    if (infilenames.size() == 0 && manifestfilename.size() == 0) 
     {
         std::cerr << "input filename is required" << std::endl;
         print_help_message(); 
@@ -125,7 +413,37 @@ void parse_arguments(int argc, char** argv)
         print_help_message(); 
         exit(1); 
     }
-    if (adaptorfilename.size() == 0)
+    if (use_mmap || namesfilename.size() > 0 || extractadaptors.size() > 0)
+    {
+        for (size_t i = 0; i < infilenames.size(); i++)
+            check_seekable_input(infilenames[i]); 
+    }
+    if (namesfilename.size() > 0 && 
+        (infilenames.size() != 1 || manifestfilename.size() > 0))
+    {
+        std::cerr << "looking reads up by name (-n) takes a single input" << std::endl;
+        exit(1); 
+    }
+    if (extractadaptors.size() > 0 && 
+        (infilenames.size() != 1 || manifestfilename.size() > 0 || 
+         infilenames[0] == "-"))
+    {
+        std::cerr << "copying adaptors out of a container (-e) takes "
+                  << "a single input file" << std::endl;
+        exit(1); 
+    }
+    if (container_output && compress_level > 0)
+    {
+        std::cerr << "containers (-C) cannot be compressed (-z)" << std::endl;
+        exit(1); 
+    }
+    if (container_output && output_format != "sff")
+    {
+        std::cerr << "containers (-C) hold SFF reads only (-f)" << std::endl;
+        exit(1); 
+    }
+    if (adaptorfilename.size() == 0 && namesfilename.size() == 0 && 
+        extractadaptors.size() == 0)
     {
         std::cerr << "adaptor filename is required" << std::endl;
         print_help_message(); 
@@ -133,12 +451,77 @@ void parse_arguments(int argc, char** argv)
     }
 }
 
-std::string get_adaptor_outfile(const std::string adaptor_name)
+/* Output stem of an input, when there are several: the -o stem and
+ * the input file name without its directory and extensions */
+std::string get_input_stem(const std::string &filename)
+{
+    std::string name = filename.substr(filename.find_last_of('/') + 1); 
+    const char *extensions[] = {".gz", ".zst", ".sff"}; 
+    for (int e = 0; e < 3; e++)
+    {
+        std::string ext(extensions[e]); 
+        if (name.size() > ext.size() && 
+            name.compare(name.size() - ext.size(), ext.size(), ext) == 0)
+            name.erase(name.size() - ext.size()); 
+    }
+    return outstem + "." + name; 
+}
+
+/* Inputs given with -i, then those of the manifest */
+void get_inputs(std::vector<SFFInput> &inputs)
+{
+    std::vector<std::string> filenames(infilenames); 
+    std::vector<std::string> stems(infilenames.size()); 
+    if (manifestfilename.size() > 0)
+    {
+        std::ifstream ifs(manifestfilename.c_str()); 
+        if (!ifs.is_open())
+        {
+            std::cerr << "Could not open input list for reading" << std::endl;
+            exit(1); 
+        }
+        std::string line; 
+        while (std::getline(ifs, line))
+        {
+            std::istringstream fields(line); 
+            std::string filename, stem; 
+            if (!(fields >> filename))
+                continue; 
+            fields >> stem; 
+            if (use_mmap)
+                check_seekable_input(filename); 
+            filenames.push_back(filename); 
+            stems.push_back(stem); 
+        }
+    }
+    inputs.resize(filenames.size()); 
+    for (size_t i = 0; i < filenames.size(); i++)
+    {
+        inputs[i].filename = filenames[i]; 
+        if (stems[i].size() > 0)
+            inputs[i].stem = stems[i]; 
+        else if (filenames.size() == 1)
+            inputs[i].stem = outstem; 
+        else
+            inputs[i].stem = get_input_stem(filenames[i]); 
+        inputs[i].reader = NULL; 
+        inputs[i].cpt = 0; 
+        inputs[i].notfound = 0; 
+        inputs[i].bytes = 0; 
+        inputs[i].container = NULL; 
+    }
+}
+
+std::string get_adaptor_outfile(const std::string &stem, 
+                                const std::string adaptor_name, 
+                                const char *extension=".sff")
 {
-    std::string retval(outstem); 
+    std::string retval(stem); 
     retval.append(".");
     retval.append(adaptor_name);
-    retval.append(".sff");
+    retval.append(extension);
+    if (compress_level > 0)
+        retval.append(".gz");
     return retval;
 }
 
@@ -154,106 +537,955 @@ void empty_buffer(fieldbuffer &buffer)
     buffer.resize(size);
 }
 
-int main(int argc, char** argv)
+FieldBatch* new_batch(const sff::SFFFileHeader &common_header)
 {
-    parse_arguments(argc, argv); 
-    
-    omp_set_num_threads(num_threads);
-
-    sff::AdaptorFinder adaptorFinder(maxmismatch); 
-    adaptorFinder.read(adaptorfilename); 
-
-    outmap outputMap; 
-    outmap::const_iterator outputIterator; 
+    FieldBatch *batch = new FieldBatch(); 
+    batch->id = 0; 
+    batch->input = 0; 
+    batch->len = 0; 
+    batch->bytes = 0; 
+    batch->mapped = NULL; 
+    batch->chunk = NULL; 
+    batch->fields.resize(buffer_size); 
+    batch->matches.resize(buffer_size); 
+    batch->spans.resize(buffer_size); 
+    batch->ngroups = 0; 
+    for (int b = 0; b < buffer_size; b++)
+        batch->fields[b] = new sff::SFFField(common_header); 
+    return batch; 
+}
 
-    sff::SFFFileReader reader(infilename); 
-    sff::SFFFileHeader common_header; 
+void delete_batch(FieldBatch *batch)
+{
+    empty_buffer(batch->fields); 
+    delete batch; 
+}
 
+/* Open an input and read its common header */
+void open_input(SFFInput &input, sff::SFFMappedReader *&mapped)
+{
+    mapped = NULL; 
+    if (use_mmap)
+        input.reader = mapped = 
+            new sff::SFFMappedReader(input.filename, decode_reads); 
+    else
+        /* Reads are not modified, so unless asked otherwise they are
+         * copied to the outputs without being decoded */
+        input.reader = new sff::SFFFileReader(input.filename, !decode_reads); 
 
-    bool hasRead = reader.read_common_header(common_header); 
+    sff::SFFFileHeader &common_header = input.common_header; 
+    bool hasRead = input.reader->read_common_header(common_header); 
     if (!hasRead)
     {
-        std::cerr << "Failed to read common header" << std::endl;
+        std::cerr << "Failed to read common header of " 
+                  << input.filename << std::endl;
         exit(2); 
     }
-    int nreads = common_header.nreads;
     if (verbose)
     {
-        printf("Common header summary:\n");
+        printf("Common header summary (%s):\n", input.filename.c_str());
         printf("\t%-30s%-20d\n", "flow_len : ", common_header.flow_len);
         printf("\t%-30s%-20d\n", "key_len: ", common_header.key_len); 
-        printf("\t%-30s%-20d\n", "Number of reads: ", nreads);
+        printf("\t%-30s%-20d\n", "Number of reads: ", common_header.nreads);
+        printf("\t%-30s%-20s\n", "Flowgram byte swap: ", sff::convert_be16_kernel());
     }
+}
 
-    int cpt = 0;         // Count number of reads
-    int notfound = 0;    // Count number of reads that were not found
+/* Whether reads with these common headers can go to the same file */
+bool same_layout(const sff::SFFFileHeader &a, const sff::SFFFileHeader &b)
+{
+    return a.flow_len == b.flow_len && a.key_len == b.key_len && 
+           a.flowgram_format == b.flowgram_format && 
+           a.flow == b.flow && a.key == b.key; 
+}
 
-    /* Buffer for multi-threading */
-    fieldbuffer buffer(buffer_size); 
-    
-    while (true)
+/* Queue operations, counting the time blocked as waiting */
+bool timed_pop(batchqueue &queue, FieldBatch *&batch, sff::StageStats &stats)
+{
+    double start = sff::now(); 
+    bool ok = queue.pop(batch); 
+    stats.wait += sff::now() - start; 
+    return ok; 
+}
+
+bool timed_push(batchqueue &queue, FieldBatch *batch, sff::StageStats &stats)
+{
+    double start = sff::now(); 
+    bool ok = queue.push(batch); 
+    stats.wait += sff::now() - start; 
+    return ok; 
+}
+
+/* Reader stage: decode reads into batches of buffer_size fields, one
+ * input after the other. 
+ * From a mapped input, only find where each batch starts and leave
+ * parsing to the matchers, so it runs on all matcher threads.
+ */
+void read_stage(std::vector<SFFInput> &inputs, 
+                batchqueue &freeBatches, 
+                batchqueue &toMatch, 
+                sff::StageStats &stats)
+{
+    double start = sff::now(); 
+    size_t id = 0; 
+    FieldBatch *batch = NULL; 
+    for (size_t i = 0; i < inputs.size(); i++)
     {
-        /* Filling buffer */
-        int buffer_len = 0;     
-        while (buffer_len < buffer_size && !reader.done())
+        SFFInput &input = inputs[i]; 
+        sff::SFFMappedReader *mapped; 
+        open_input(input, mapped); 
+        if (merge_outputs && !same_layout(input.common_header, 
+                                          inputs[0].common_header))
+        {
+            std::cerr << "Cannot merge " << input.filename << " with " 
+                      << inputs[0].filename << ": flows or keys differ" 
+                      << std::endl;
+            exit(2); 
+        }
+        sff::VirtualSFFReader *reader = input.reader; 
+        int nreads = input.common_header.nreads;
+        uint64_t consumed = reader->get_bytes_read(); 
+        /* Waiting for a recycled batch bounds the number of reads in 
+         * flight */
+        while (timed_pop(freeBatches, batch, stats))
         {
-            sff::SFFField *field = new sff::SFFField(common_header); 
-            if (!reader.read_field(*field))
+            if (&batch->fields[0]->get_key() != &input.common_header.key)
             {
-                std::cerr << "Error reading field" << std::endl;
-                exit(2);
+                /* Batch last used by another input */
+                for (int b = 0; b < buffer_size; b++)
+                    batch->fields[b]->set_common_header(input.common_header); 
             }
-            buffer[buffer_len] = field;
-            buffer_len ++;
+            batch->input = i; 
+            batch->mapped = mapped; 
+            /* Filling buffer */
+            int buffer_len = 0;     
+            if (mapped != NULL)
+            {
+                buffer_len = mapped->scan_records(buffer_size, &batch->chunk); 
+                if (buffer_len < 0)
+                {
+                    std::cerr << "Error reading field" << std::endl;
+                    exit(2);
+                }
+            }
+            while (mapped == NULL && buffer_len < buffer_size && !reader->done())
+            {
+                if (!reader->read_field(*batch->fields[buffer_len]))
+                {
+                    std::cerr << "Error reading field" << std::endl;
+                    exit(2);
+                }
+                buffer_len ++;
+            }
+            batch->len = buffer_len; 
+            batch->bytes = reader->get_bytes_read() - consumed; 
+            consumed += batch->bytes; 
+            if (buffer_len == 0) 
+            {
+                freeBatches.push(batch); 
+                break;
+            }
+
+            if (input.cpt >= nreads)
+            {
+                std::cerr << "Too many reads in SFF file " 
+                          << input.filename << std::endl;
+                exit(2); 
+            }
+            input.cpt += buffer_len; 
+            stats.reads += buffer_len; 
+            stats.bytes += batch->bytes; 
+            batch->id = id++; 
+            timed_push(toMatch, batch, stats); 
         }
-        if (buffer_len == 0) break;
+        input.bytes = reader->get_bytes_read(); 
+    }
+    toMatch.close(); 
+    stats.busy = sff::now() - start - stats.wait; 
+}
+
+/* Move the adaptor clips of a matched read past the adaptors of span,
+ * so that they are trimmed by whatever reads the output. Clips only 
+ * ever grow: bases already clipped stay clipped */
+void clip_field_adaptors(sff::SFFField &field, const sff::AdaptorSpan &span)
+{
+    const sff::SFFReadView &view = field.get_view(); 
+    int left = std::max((int)view.clip_adapter_left, span.left + 1); 
+    int right = view.clip_adapter_right; 
+    if (span.right < (int)view.nbases)
+        right = (right == 0) ? span.right : std::min(right, span.right); 
+    field.set_adaptor_clips(left, right); 
+}
 
-        if (cpt >= nreads)
+/* Group the reads of a batch by the adaptor they matched. groupOf
+ * belongs to the calling matcher, groups are recycled with the batch */
+void group_matches(FieldBatch *batch, 
+                   std::unordered_map<std::string, size_t> &groupOf)
+{
+    groupOf.clear(); 
+    batch->ngroups = 0; 
+    for (int b = 0; b < batch->len; b++)
+    {
+        const std::string &match = batch->matches[b]; 
+        std::unordered_map<std::string, size_t>::const_iterator found = 
+            groupOf.find(match); 
+        size_t g; 
+        if (found == groupOf.end())
         {
-            std::cerr << "Too many reads in SFF file." << std::endl;
-            exit(2); 
+            g = batch->ngroups++; 
+            if (g == batch->groups.size())
+                batch->groups.push_back(AdaptorGroup()); 
+            batch->groups[g].name = match; 
+            batch->groups[g].reads.clear(); 
+            groupOf[match] = g; 
         }
-        /* Now process buffer */
-        #pragma omp parallel for schedule(static,1) ordered
-        for (int b = 0; b < buffer_len; b++)
+        else
+            g = found->second; 
+        batch->groups[g].reads.push_back(b); 
+    }
+}
+
+/* Matcher stage: one per thread, attempt to find a matching adaptor 
+ * for every read of a batch, and group the reads by adaptor. The last
+ * matcher to run out of batches 
+ * closes the writer queue.
+ * Counting goes to locals, copied to stats once done, so threads do
+ * not share cache lines while matching.
+ */
+void match_stage(sff::VirtualAdaptorFinder &adaptorFinder, 
+                 batchqueue &toMatch, 
+                 batchqueue &toWrite, 
+                 std::atomic<int> &running, 
+                 sff::StageStats &stats, 
+                 sff::MatchStats &matching)
+{
+    double start = sff::now(); 
+    sff::StageStats local; 
+    sff::MatchStats localMatching; 
+    std::unordered_map<std::string, size_t> groupOf; 
+    FieldBatch *batch; 
+    while (timed_pop(toMatch, batch, local))
+    {
+        if (batch->mapped != NULL && 
+            !batch->mapped->parse_fields(batch->chunk, batch->len, 
+                                         batch->fields))
         {
-            /* Attempt to find a matching adaptor in current read */
-            std::string match; 
-            bool found = adaptorFinder.find(*buffer[b], match); 
-            if (!found)
-            {
+            std::cerr << "Error reading field" << std::endl;
+            exit(2);
+        }
+        for (int b = 0; b < batch->len; b++)
+        {
+            std::string &match = batch->matches[b]; 
+            if (!adaptorFinder.find(*batch->fields[b], match, &localMatching, 
+                                    &batch->spans[b]))
                 match = UNMATCHED; // Set match name to unmatched string
-                notfound ++; 
+            else if (clip_adaptors)
+                clip_field_adaptors(*batch->fields[b], batch->spans[b]); 
+        }
+        group_matches(batch, groupOf); 
+        local.reads += batch->len; 
+        local.bytes += batch->bytes; 
+        timed_push(toWrite, batch, local); 
+    }
+    local.busy = sff::now() - start - local.wait; 
+    stats = local; 
+    matching = localMatching; 
+    if (--running == 0)
+        toWrite.close(); 
+}
+
+/* Container of the reads of an input, or of all of them when merged */
+std::string get_container_outfile(const std::string &stem)
+{
+    return stem + ".sff"; 
+}
+
+/* Write the reads of a batch to its container, opened with the first
+ * batch written to it */
+void write_container_batch(FieldBatch *batch, SFFInput &input, 
+                           sff::SFFContainerWriter *&container, 
+                           const std::string &stem)
+{
+    if (container == NULL)
+    {
+        container = new sff::SFFContainerWriter(get_container_outfile(stem), 
+                                                (size_t)write_buffer_mb*1024*1024); 
+        container->write_common_header(input.common_header); 
+    }
+    for (size_t g = 0; g < batch->ngroups; g++)
+    {
+        const AdaptorGroup &group = batch->groups[g]; 
+        for (size_t r = 0; r < group.reads.size(); r++)
+        {
+            if (!container->write_field(group.name, 
+                                        *batch->fields[group.reads[r]]))
+            {
+                std::cerr << "Could not write field to disk" << std::endl;
+                exit(2); 
             }
-            #pragma omp ordered
+        }
+    }
+}
+
+/* Create the files of an adaptor, in the output format */
+AdaptorOutput open_output(const std::string &stem, 
+                          const std::string &adaptor, 
+                          const sff::SFFFileHeader &common_header, 
+                          sff::SFFWriteFlusher *flusher, 
+                          sff::BGZFCompressor *compressor)
+{
+    AdaptorOutput output = {NULL, NULL, NULL}; 
+    size_t buffer_bytes = (size_t)write_buffer_mb*1024*1024; 
+    /* Files are created here, and fail to be when out of descriptors */
+    try
+    {
+        if (output_format == "fastq")
+            output.sequences = new sff::SequenceFileWriter(
+                    get_adaptor_outfile(stem, adaptor, ".fastq"), sff::FASTQ, 
+                    buffer_bytes, flusher, compressor); 
+        else if (output_format == "fasta")
+        {
+            output.sequences = new sff::SequenceFileWriter(
+                    get_adaptor_outfile(stem, adaptor, ".fasta"), sff::FASTA, 
+                    buffer_bytes, flusher, compressor); 
+            output.qualities = new sff::SequenceFileWriter(
+                    get_adaptor_outfile(stem, adaptor, ".qual"), sff::QUAL, 
+                    buffer_bytes, flusher, compressor); 
+        }
+        else
+        {
+            output.reads = new sff::SFFFileWriter(
+                    get_adaptor_outfile(stem, adaptor), 
+                    buffer_bytes, flusher, compressor); 
+            output.reads->write_common_header(common_header); 
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << "Could not write field to disk" << std::endl;
+        exit(2); 
+    }
+    return output; 
+}
+
+/* Every file of output, to be touched or removed from the cache */
+void get_output_files(const AdaptorOutput &output, 
+                      std::vector<sff::BufferedFileWriter*> &files)
+{
+    files.clear(); 
+    if (output.reads != NULL)
+        files.push_back(output.reads); 
+    if (output.sequences != NULL)
+        files.push_back(output.sequences); 
+    if (output.qualities != NULL)
+        files.push_back(output.qualities); 
+}
+
+/* Write one read to the files of an adaptor. Sequences are those 
+ * within the clips, less the adaptors found with strip_adaptors */
+bool write_output(const AdaptorOutput &output, sff::SFFField &field, 
+                  const sff::AdaptorSpan *span)
+{
+    if (output.reads != NULL)
+        return output.reads->write_field(field); 
+    int left = field.get_left_clip_value(); 
+    int right = field.get_right_clip_value(); 
+    if (span != NULL)
+    {
+        left = std::max(left, span->left); 
+        right = std::min(right, span->right); 
+    }
+    return output.sequences->write_field(field, left, right) && 
+           (output.qualities == NULL || 
+            output.qualities->write_field(field, left, right)); 
+}
+
+/* Write the reads of a batch to the adaptor specific files, those of
+ * the batch input or the merged ones, one adaptor at a time. Reads of
+ * an adaptor stay in batch order. Outputs go through writerCache, 
+ * which bounds the number of open files. With -C, reads go to the 
+ * container of the input, or to mergedContainer */
+void write_batch(FieldBatch *batch, 
+                 std::vector<SFFInput> &inputs, 
+                 outmap &mergedOutputs, 
+                 sff::SFFContainerWriter *&mergedContainer, 
+                 sff::SFFWriteFlusher *flusher, 
+                 sff::BGZFCompressor *compressor, 
+                 sff::SFFWriterCache &writerCache)
+{
+    SFFInput &input = inputs[batch->input]; 
+    outmap &outputMap = merge_outputs ? mergedOutputs : input.outputs; 
+    const std::string &stem = merge_outputs ? outstem : input.stem; 
+    for (size_t g = 0; g < batch->ngroups; g++)
+        if (batch->groups[g].name == UNMATCHED)
+            input.notfound += batch->groups[g].reads.size(); 
+    if (container_output)
+    {
+        write_container_batch(batch, input, merge_outputs ? 
+                              mergedContainer : input.container, stem); 
+        return; 
+    }
+    std::vector<sff::BufferedFileWriter*> files; 
+    for (size_t g = 0; g < batch->ngroups; g++)
+    {
+        const AdaptorGroup &group = batch->groups[g]; 
+        outmap::const_iterator outputIterator = outputMap.find(group.name); 
+        if (outputIterator == outputMap.end())
+        {
+            /* This is the first time we find this adaptor */
+            outputMap[group.name] = open_output(stem, group.name, 
+                                                input.common_header, 
+                                                flusher, compressor); 
+            outputIterator = outputMap.find(group.name); 
+        }
+        const AdaptorOutput &output = outputIterator->second; 
+        get_output_files(output, files); 
+        for (size_t f = 0; f < files.size(); f++)
+        {
+            if (!writerCache.touch(files[f]))
             {
-                outputIterator = outputMap.find(match); 
-                if (outputIterator == outputMap.end())
-                {
-                    /* This is the first time we find this adaptor */
-                    std::string adaptorfilename = get_adaptor_outfile(match); 
-                    sff::SFFFileWriter *writer = new sff::SFFFileWriter(adaptorfilename); 
-                    outputMap[match] = writer; 
-                    outputMap[match]->write_common_header(common_header); 
-                }
-                if (!outputMap[match]->write_field(*buffer[b]))
+                std::cerr << "Could not write field to disk" << std::endl;
+                exit(2); 
+            }
+        }
+        bool strip = strip_adaptors && group.name != UNMATCHED; 
+        for (size_t r = 0; r < group.reads.size(); r++)
+        {
+            int read = group.reads[r]; 
+            if (!write_output(output, *batch->fields[read], 
+                              strip ? &batch->spans[read] : NULL))
+            {
+                std::cerr << "Could not write field to disk" << std::endl;
+                exit(2); 
+            }
+        }
+    }
+}
+
+/* Writer stage: write batches in input order, restored from the
+ * order matchers complete them in. With unordered, batches are 
+ * written as soon as they are matched */
+void write_stage(std::vector<SFFInput> &inputs, 
+                 batchqueue &toWrite, 
+                 batchqueue &freeBatches, 
+                 outmap &mergedOutputs, 
+                 sff::SFFContainerWriter *&mergedContainer, 
+                 sff::SFFWriteFlusher *flusher, 
+                 sff::BGZFCompressor *compressor, 
+                 sff::SFFWriterCache &writerCache, 
+                 sff::StageStats &stats)
+{
+    double start = sff::now(); 
+    /* Batches completed out of order, waiting for their turn */
+    std::map<size_t, FieldBatch*> pending; 
+    size_t next = 0; 
+    /* Write a batch and hand it back to the reader */
+    auto write = [&](FieldBatch *batch) {
+        write_batch(batch, inputs, mergedOutputs, mergedContainer, flusher, 
+                    compressor, writerCache); 
+        stats.reads += batch->len; 
+        stats.bytes += batch->bytes; 
+        freeBatches.push(batch); 
+    }; 
+    FieldBatch *batch; 
+    while (timed_pop(toWrite, batch, stats))
+    {
+        if (unordered)
+        {
+            write(batch); 
+            continue; 
+        }
+        pending[batch->id] = batch; 
+        while (!pending.empty() && pending.begin()->first == next)
+        {
+            write(pending.begin()->second); 
+            pending.erase(pending.begin()); 
+            next ++; 
+        }
+    }
+    stats.busy += sff::now() - start - stats.wait; 
+}
+
+/* Index the adaptor specific files, update their common headers and
+ * close them. What was written to each is added to reports */
+void close_outputs(outmap &outputMap, const sff::SFFFileHeader &common_header, 
+                   sff::SFFWriterCache &writerCache, 
+                   std::vector<OutputReport> &reports)
+{
+    outmap::const_iterator outputIterator; 
+    std::vector<sff::BufferedFileWriter*> files; 
+    for (outputIterator = outputMap.begin(); 
+         outputIterator != outputMap.end(); 
+         ++outputIterator)
+    {
+        const std::string &adaptor = outputIterator->first; 
+        const AdaptorOutput &output = outputIterator->second; 
+        int nreads; 
+        if (output.reads != NULL)
+        {
+            sff::SFFFileWriter *writer = output.reads; 
+            nreads = writer->get_number_of_fields_written(); 
+            sff::SFFFileHeader fixedHeader(common_header); 
+            fixedHeader.nreads = nreads;
+            if (!writerCache.touch(writer) || !writer->write_index() || 
+                !writer->write_common_header(fixedHeader))
+            {
+                std::cerr << "Could not write field to disk" << std::endl;
+                exit(2); 
+            }
+            OutputReport report = {writer->get_filename(), adaptor, nreads, 
+                                   writer->get_bytes_written(), 
+                                   writer->get_write_seconds(), 
+                                   writer->get_compress_seconds()}; 
+            reports.push_back(report); 
+        }
+        else
+        {
+            /* Text outputs have nothing to update, they only need 
+             * their buffers written */
+            nreads = output.sequences->get_number_of_fields_written(); 
+            sff::SequenceFileWriter *writers[2] = {output.sequences, 
+                                                   output.qualities}; 
+            for (int w = 0; w < 2 && writers[w] != NULL; w++)
+            {
+                if (!writerCache.touch(writers[w]) || !writers[w]->flush())
                 {
                     std::cerr << "Could not write field to disk" << std::endl;
                     exit(2); 
                 }
+                OutputReport report = {writers[w]->get_filename(), adaptor, 
+                                       nreads, writers[w]->get_bytes_written(), 
+                                       writers[w]->get_write_seconds(), 
+                                       writers[w]->get_compress_seconds()}; 
+                reports.push_back(report); 
             }
         }
-        cpt += buffer_len; 
-        /* clean-up buffer */
-        empty_buffer(buffer); 
+        if (verbose)
+            printf("\t\t%-30s%-20d\n", adaptor.c_str(), nreads);
+        get_output_files(output, files); 
+        for (size_t f = 0; f < files.size(); f++)
+        {
+            writerCache.remove(files[f]); 
+            delete files[f]; 
+        }
     }
-    if (cpt < nreads)
+    outputMap.clear(); 
+}
+
+/* Write what a container still buffers and its index, and close it.
+ * Each adaptor is reported as an output, in the container */
+void close_container(sff::SFFContainerWriter *&container, 
+                     const sff::SFFFileHeader &common_header, 
+                     const std::string &stem, 
+                     std::vector<OutputReport> &reports)
+{
+    if (container == NULL)
+        return; 
+    if (!container->close(common_header))
     {
-        std::cerr << "Incorrect number of reads from SFFFile: " << std::endl;
-        std::cerr << "\tExpected " << nreads << std::endl
-                  << "\tRead " << cpt << std::endl;
+        std::cerr << "Could not write field to disk" << std::endl;
         exit(2); 
     }
+    std::vector<sff::SFFContainerWriter::AdaptorSummary> adaptors; 
+    container->get_adaptors(adaptors); 
+    for (size_t a = 0; a < adaptors.size(); a++)
+    {
+        if (verbose)
+            printf("\t\t%-30s%-20u\n", adaptors[a].name.c_str(), 
+                   adaptors[a].nreads);
+        OutputReport report = {get_container_outfile(stem), adaptors[a].name, 
+                               (int)adaptors[a].nreads, adaptors[a].bytes, 
+                               adaptors[a].write_seconds, 0}; 
+        reports.push_back(report); 
+    }
+    delete container; 
+    container = NULL; 
+}
+
+/* String as a JSON literal */
+std::string json_string(const std::string &str)
+{
+    std::string out("\""); 
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        unsigned char c = str[i]; 
+        if (c == '"' || c == '\\')
+        {
+            out += '\\'; 
+            out += c; 
+        }
+        else if (c < 0x20)
+        {
+            char escaped[8]; 
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c); 
+            out += escaped; 
+        }
+        else
+            out += c; 
+    }
+    out += '"'; 
+    return out; 
+}
+
+double per_second(uint64_t count, double seconds)
+{
+    return (seconds > 0) ? count / seconds : 0; 
+}
+
+void write_stage_report(FILE *out, const char *name, int threads, 
+                        const sff::StageStats &stats, bool last)
+{
+    fprintf(out, "    %s: {\"threads\": %d, \"busy_seconds\": %.6f, "
+            "\"wait_seconds\": %.6f, \"reads\": %llu, \"bytes\": %llu, "
+            "\"reads_per_second\": %.1f, \"bytes_per_second\": %.1f}%s\n", 
+            json_string(name).c_str(), threads, stats.busy, stats.wait, 
+            (unsigned long long)stats.reads, (unsigned long long)stats.bytes, 
+            per_second(stats.reads, stats.busy), 
+            per_second(stats.bytes, stats.busy), last ? "" : ","); 
+}
+
+/* Write the timings and counters of the run to reportfilename, as 
+ * JSON. Stage bytes are those of the input reads going through the
+ * stage. Stage rates are over the time the stage was busy, summed 
+ * over its threads, and the run rates over the elapsed time. The 
+ * histogram counts matched reads by their distance to the adaptor,
+ * perfect matches being at distance 0.
+ */
+void write_report(const std::vector<SFFInput> &inputs, 
+                  const RunStats &stats, double elapsed)
+{
+    FILE *out = fopen(reportfilename.c_str(), "w"); 
+    if (out == NULL)
+    {
+        std::cerr << "Could not open report file for writing" << std::endl;
+        exit(1); 
+    }
+    sff::StageStats match; 
+    sff::MatchStats matching; 
+    for (int t = 0; t < num_threads; t++)
+    {
+        match.merge(stats.match[t]); 
+        matching.merge(stats.matching[t]); 
+    }
+    std::vector<uint64_t> histogram(matching.distances); 
+    histogram.resize(std::max((size_t)maxmismatch + 1, histogram.size()), 0); 
+    histogram[0] = matching.perfect; 
+    uint64_t bytes = 0; 
+    for (size_t i = 0; i < inputs.size(); i++)
+        bytes += inputs[i].bytes; 
+    uint64_t bytes_written = 0; 
+    double write_seconds = 0; 
+    double compress_seconds = 0; 
+    for (size_t o = 0; o < stats.outputs.size(); o++)
+    {
+        bytes_written += stats.outputs[o].bytes; 
+        write_seconds += stats.outputs[o].write_seconds; 
+        compress_seconds += stats.outputs[o].compress_seconds; 
+    }
+
+    fprintf(out, "{\n"); 
+    fprintf(out, "  \"program\": %s,\n", json_string(PRG_NAME).c_str()); 
+    fprintf(out, "  \"threads\": %d,\n", num_threads); 
+    fprintf(out, "  \"elapsed_seconds\": %.6f,\n", elapsed); 
+    fprintf(out, "  \"reads\": %llu,\n", (unsigned long long)stats.read.reads); 
+    fprintf(out, "  \"bytes\": %llu,\n", (unsigned long long)bytes); 
+    fprintf(out, "  \"reads_per_second\": %.1f,\n", 
+            per_second(stats.read.reads, elapsed)); 
+    fprintf(out, "  \"bytes_per_second\": %.1f,\n", 
+            per_second(bytes, elapsed)); 
+    fprintf(out, "  \"stages\": {\n"); 
+    write_stage_report(out, "read", 1, stats.read, false); 
+    write_stage_report(out, "match", num_threads, match, false); 
+    write_stage_report(out, "write", 1, stats.write, true); 
+    fprintf(out, "  },\n"); 
+    fprintf(out, "  \"bytes_written\": %llu,\n", 
+            (unsigned long long)bytes_written); 
+    fprintf(out, "  \"output_releases\": %llu,\n", 
+            (unsigned long long)stats.output_releases); 
+    fprintf(out, "  \"write_seconds\": %.6f,\n", write_seconds); 
+    fprintf(out, "  \"compress_seconds\": %.6f,\n", compress_seconds); 
+    fprintf(out, "  \"matches\": {\"perfect\": %llu, \"imperfect\": %llu, "
+            "\"unmatched\": %llu, \"distance_histogram\": [", 
+            (unsigned long long)matching.perfect, 
+            (unsigned long long)matching.imperfect, 
+            (unsigned long long)matching.unmatched); 
+    for (size_t d = 0; d < histogram.size(); d++)
+        fprintf(out, "%s%llu", d > 0 ? ", " : "", 
+                (unsigned long long)histogram[d]); 
+    fprintf(out, "]},\n"); 
+    fprintf(out, "  \"inputs\": [\n"); 
+    for (size_t i = 0; i < inputs.size(); i++)
+        fprintf(out, "    {\"file\": %s, \"reads\": %d, \"unmatched\": %d, "
+                "\"bytes\": %llu}%s\n", 
+                json_string(inputs[i].filename).c_str(), inputs[i].cpt, 
+                inputs[i].notfound, (unsigned long long)inputs[i].bytes, 
+                i + 1 < inputs.size() ? "," : ""); 
+    fprintf(out, "  ],\n"); 
+    fprintf(out, "  \"outputs\": [\n"); 
+    for (size_t o = 0; o < stats.outputs.size(); o++)
+    {
+        const OutputReport &report = stats.outputs[o]; 
+        fprintf(out, "    {\"file\": %s, \"adaptor\": %s, \"reads\": %d, "
+                "\"bytes_written\": %llu, \"write_seconds\": %.6f, "
+                "\"compress_seconds\": %.6f}%s\n", 
+                json_string(report.filename).c_str(), 
+                json_string(report.adaptor).c_str(), report.nreads, 
+                (unsigned long long)report.bytes, report.write_seconds, 
+                report.compress_seconds, 
+                o + 1 < stats.outputs.size() ? "," : ""); 
+    }
+    fprintf(out, "  ]\n"); 
+    fprintf(out, "}\n"); 
+    if (fclose(out) != 0)
+    {
+        std::cerr << "Could not write report file" << std::endl;
+        exit(2); 
+    }
+}
+
+/* Lookup mode: write the reads named in namesfilename, separated by
+ * white spaces, to <output_stem>.sff. Reads are found through the 
+ * index and written in input order */
+int extract_reads()
+{
+    std::ifstream ifs(namesfilename.c_str()); 
+    if (!ifs.is_open())
+    {
+        std::cerr << "Could not open names file for reading" << std::endl;
+        exit(1); 
+    }
+    std::vector<std::string> names; 
+    std::string name; 
+    while (ifs >> name)
+        names.push_back(name); 
+    ifs.close(); 
+
+    sff::SFFIndexedReader reader(infilenames[0], decode_reads); 
+    sff::SFFFileHeader common_header; 
+    if (!reader.read_common_header(common_header))
+    {
+        std::cerr << "Failed to read common header" << std::endl;
+        exit(2); 
+    }
+    std::vector<uint64_t> offsets; 
+    size_t missing = reader.find_offsets(names, offsets); 
+
+    sff::BGZFCompressor *compressor = NULL; 
+    if (compress_level > 0)
+        compressor = new sff::BGZFCompressor(compress_level, num_threads); 
+    sff::SFFFileWriter *writer = new sff::SFFFileWriter(
+            outstem + (compress_level > 0 ? ".sff.gz" : ".sff"), 
+            (size_t)write_buffer_mb*1024*1024, NULL, compressor); 
+    writer->write_common_header(common_header); 
+    sff::SFFField field(common_header); 
+    for (size_t i = 0; i < offsets.size(); i++)
+    {
+        if (!reader.read_field_at(offsets[i], field))
+        {
+            std::cerr << "Error reading field" << std::endl;
+            exit(2);
+        }
+        if (!writer->write_field(field))
+        {
+            std::cerr << "Could not write field to disk" << std::endl;
+            exit(2); 
+        }
+    }
+    common_header.nreads = writer->get_number_of_fields_written(); 
+    if (!writer->write_index() || !writer->write_common_header(common_header))
+    {
+        std::cerr << "Could not write field to disk" << std::endl;
+        exit(2); 
+    }
+    /* The writer uses the compressor until it is closed */
+    delete writer; 
+    delete compressor; 
+
+    if (verbose)
+    {
+        printf("Lookup summary:\n");
+        printf("\t%-30s%-20s\n", "Index: ", reader.get_index_source());
+        printf("\t%-30s%-20zu\n", "Names requested: ", names.size());
+        printf("\t%-30s%-20zu\n", "Reads extracted: ", offsets.size());
+        printf("\t%-30s%-20zu\n", "Not found: ", missing);
+    }
+    if (missing > 0)
+        std::cerr << missing << " read names not found in the input" << std::endl;
+    return 0; 
+}
+
+/* Extraction mode: copy the reads of each of extractadaptors out of the
+ * container to '<output_stem>.adaptor.sff', in one forward pass over 
+ * the extents of the adaptor */
+int extract_adaptors()
+{
+    sff::SFFContainerReader reader(infilenames[0]); 
+    sff::SFFFileHeader common_header; 
+    if (!reader.read_common_header(common_header))
+    {
+        std::cerr << "Failed to read common header, or "
+                  << infilenames[0] << " is not a container" << std::endl;
+        exit(2); 
+    }
+    sff::BGZFCompressor *compressor = NULL; 
+    if (compress_level > 0)
+        compressor = new sff::BGZFCompressor(compress_level, num_threads); 
+    if (verbose)
+        printf("Extraction summary:\n");
+    for (size_t a = 0; a < extractadaptors.size(); a++)
+    {
+        const std::string &adaptor = extractadaptors[a]; 
+        std::string filename = get_adaptor_outfile(outstem, adaptor); 
+        sff::SFFFileWriter *writer = new sff::SFFFileWriter(filename, 
+                (size_t)write_buffer_mb*1024*1024, NULL, compressor); 
+        writer->write_common_header(common_header); 
+        if (!reader.extract(adaptor, *writer))
+        {
+            std::cerr << "Could not copy " << adaptor << " out of " 
+                      << infilenames[0] << std::endl;
+            delete writer; 
+            remove(filename.c_str()); 
+            exit(2); 
+        }
+        sff::SFFFileHeader fixedHeader(common_header); 
+        fixedHeader.nreads = writer->get_number_of_fields_written(); 
+        if (!writer->write_index() || !writer->write_common_header(fixedHeader))
+        {
+            std::cerr << "Could not write field to disk" << std::endl;
+            exit(2); 
+        }
+        delete writer; 
+        if (verbose)
+            printf("\t\t%-30s%-20d\n", adaptor.c_str(), fixedHeader.nreads);
+    }
+    delete compressor; 
+    return 0; 
+}
+
+int main(int argc, char** argv)
+{
+    parse_arguments(argc, argv); 
+    if (namesfilename.size() > 0)
+        return extract_reads(); 
+    if (extractadaptors.size() > 0)
+        return extract_adaptors(); 
+    double start = sff::now(); 
+    
+    /* Adaptors are read once, whatever the number of inputs. With 
+     * right end adaptors, both ends are matched in the same pass */
+    sff::VirtualAdaptorFinder *adaptorFinder; 
+    if (rightadaptorfilename.size() > 0)
+    {
+        sff::PairedAdaptorFinder *pairedFinder = new sff::PairedAdaptorFinder(
+                maxmismatch, distance_mode, neighborhood_cap); 
+        pairedFinder->read(adaptorfilename, rightadaptorfilename); 
+        adaptorFinder = pairedFinder; 
+    }
+    else
+    {
+        sff::AdaptorFinder *leftFinder = new sff::AdaptorFinder(
+                maxmismatch, distance_mode, neighborhood_cap); 
+        leftFinder->read(adaptorfilename); 
+        adaptorFinder = leftFinder; 
+    }
+    if (verbose && maxmismatch > 0)
+        printf("Imperfect matching: %s\n", 
+               distance_mode == sff::HAMMING ? "packed substitutions" : 
+               adaptorFinder->has_neighborhood_index() ? 
+               "neighborhood index" : "alignment"); 
+
+    std::vector<SFFInput> inputs; 
+    get_inputs(inputs); 
+    outmap mergedOutputs; 
+    sff::SFFContainerWriter *mergedContainer = NULL; 
+
+    /* Reading, matching and writing run concurrently. Queues hold a 
+     * few batches per matcher thread so every stage stays busy, and
+     * block the faster stages when they get too far ahead. Inputs 
+     * are read one after the other, but the matchers are shared, so 
+     * they carry on from one input to the next without waiting for 
+     * the previous one to be written.
+     */
+    batchqueue toMatch(2*num_threads); 
+    batchqueue toWrite(2*num_threads); 
+    std::atomic<int> running(num_threads); 
+
+    /* Pool of recycled batches, enough to fill every queue and keep
+     * each stage busy. Fields are bound to the common header of the
+     * input they are read from */
+    sff::SFFFileHeader unbound; 
+    unbound.key_len = 0; 
+    unbound.flow_len = 0; 
+    int nbatches = 4*num_threads + 2; 
+    batchqueue freeBatches(nbatches); 
+    for (int i = 0; i < nbatches; i++)
+        freeBatches.push(new_batch(unbound)); 
+
+    /* Each thread only touches its own stats */
+    RunStats stats; 
+    stats.match.resize(num_threads); 
+    stats.matching.resize(num_threads); 
+
+    std::thread readerThread(read_stage, std::ref(inputs), 
+                             std::ref(freeBatches), std::ref(toMatch), 
+                             std::ref(stats.read)); 
+    std::vector<std::thread> matcherThreads; 
+    for (int t = 0; t < num_threads; t++)
+        matcherThreads.push_back(std::thread(match_stage, 
+                                             std::ref(*adaptorFinder), 
+                                             std::ref(toMatch), 
+                                             std::ref(toWrite), 
+                                             std::ref(running), 
+                                             std::ref(stats.match[t]), 
+                                             std::ref(stats.matching[t]))); 
+    /* Optionally, full output buffers are written to disk by a 
+     * separate thread while the writer stage carries on */
+    sff::SFFWriteFlusher *flusher = NULL; 
+    if (background_flush)
+        flusher = new sff::SFFWriteFlusher(); 
+    /* Optionally, output buffers are compressed by a pool of threads */
+    sff::BGZFCompressor *compressor = NULL; 
+    if (compress_level > 0)
+        compressor = new sff::BGZFCompressor(compress_level, num_threads); 
+    /* Outputs beyond the open file limit are closed and reopened as
+     * needed. Inputs stay open until the end of the run, and may hold
+     * a second descriptor when read through a stream */
+    size_t max_open = max_open_outputs; 
+    if (max_open == 0)
+        max_open = sff::SFFWriterCache::get_max_open_files(16 + 2*inputs.size()); 
+    /* The files of an adaptor are written together, so they must all 
+     * fit in the cache */
+    max_open = std::max(max_open, (size_t)(output_format == "fasta" ? 2 : 1)); 
+    sff::SFFWriterCache writerCache(max_open); 
+    write_stage(inputs, toWrite, freeBatches, mergedOutputs, mergedContainer, 
+                flusher, compressor, writerCache, stats.write); 
+
+    readerThread.join(); 
+    for (int t = 0; t < num_threads; t++)
+        matcherThreads[t].join(); 
+    delete adaptorFinder; 
+    freeBatches.close(); 
+    FieldBatch *batch; 
+    while (freeBatches.pop(batch))
+        delete_batch(batch); 
+
+    int cpt = 0; 
+    int notfound = 0; 
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        SFFInput &input = inputs[i]; 
+        int nreads = input.common_header.nreads;
+        if (input.cpt < nreads)
+        {
+            std::cerr << "Incorrect number of reads from SFFFile: " 
+                      << input.filename << std::endl;
+            std::cerr << "\tExpected " << nreads << std::endl
+                      << "\tRead " << input.cpt << std::endl;
+            exit(2); 
+        }
+        cpt += input.cpt; 
+        notfound += input.notfound; 
+    }
 
     if (verbose)
     {
@@ -263,21 +1495,38 @@ int main(int argc, char** argv)
         printf("\t%-30s%-20d\n", "Unmatched: ", notfound); 
         printf("\t%-30s%-20d\n", "Matched to an adaptor: ", cpt-notfound);
     }
-    /* Finally, we need to update the common headers of 
-     * adaptor specific files
+    /* Finally, we need to index the adaptor specific files and 
+     * update their common headers
      */
-    for (outputIterator = outputMap.begin(); 
-         outputIterator != outputMap.end(); 
-         ++outputIterator)
+    double closing = sff::now(); 
+    if (merge_outputs)
     {
-        int nreads = outputIterator->second->get_number_of_fields_written(); 
-        sff::SFFFileHeader fixedHeader(common_header); 
-        fixedHeader.nreads = nreads;
-        outputIterator->second->write_common_header(fixedHeader); 
-        if (verbose)
-            printf("\t\t%-30s%-20d\n", outputIterator->first.c_str(), nreads);
-        delete outputIterator->second;
+        sff::SFFFileHeader mergedHeader(inputs[0].common_header); 
+        close_outputs(mergedOutputs, mergedHeader, writerCache, stats.outputs); 
+        close_container(mergedContainer, mergedHeader, outstem, stats.outputs); 
     }
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (verbose && inputs.size() > 1)
+            printf("\t%s: %d reads, %d unmatched\n", inputs[i].filename.c_str(), 
+                   inputs[i].cpt, inputs[i].notfound);
+        close_outputs(inputs[i].outputs, inputs[i].common_header, 
+                      writerCache, stats.outputs); 
+        close_container(inputs[i].container, inputs[i].common_header, 
+                        inputs[i].stem, stats.outputs); 
+    }
+    stats.output_releases = writerCache.get_releases(); 
+    if (verbose && stats.output_releases > 0)
+        printf("\t%-30s%-20llu\n", "Outputs closed to open others: ", 
+               (unsigned long long)stats.output_releases);
+    delete flusher; 
+    delete compressor; 
+    stats.write.busy += sff::now() - closing; 
+    for (size_t i = 0; i < inputs.size(); i++)
+        delete inputs[i].reader; 
+
+    if (reportfilename.size() > 0)
+        write_report(inputs, stats, sff::now() - start); 
 
     return 0;
 }
@@ -0,0 +1,75 @@
+#ifndef _SFFSPLITTER_STATS_HPP_
+#define _SFFSPLITTER_STATS_HPP_
+
+#include <vector>
+#include <chrono>
+#include <stdint.h>
+
+namespace sff
+{
+    /* Seconds on a monotonic clock, to time stages */
+    inline double now()
+    {
+        return std::chrono::duration<double>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /* Time and work of one thread of a pipeline stage. busy is time
+     * spent working, wait is time spent blocked on the queues around
+     * the stage. Each thread owns its stats, merged once the threads
+     * are joined, so counting needs no synchronization.
+     */
+    struct StageStats
+    {
+        double busy;
+        double wait;
+        uint64_t reads;
+        uint64_t bytes;
+
+        StageStats() :
+            busy(0), wait(0), reads(0), bytes(0)
+        {}
+
+        void merge(const StageStats &other)
+        {
+            busy += other.busy;
+            wait += other.wait;
+            reads += other.reads;
+            bytes += other.bytes;
+        }
+    };
+
+    /* Outcome of the adaptor lookups of one matcher thread. distances
+     * counts imperfect hits by their distance to the adaptor */
+    struct MatchStats
+    {
+        uint64_t perfect;
+        uint64_t imperfect;
+        uint64_t unmatched;
+        std::vector<uint64_t> distances;
+
+        MatchStats() :
+            perfect(0), imperfect(0), unmatched(0)
+        {}
+
+        void add_imperfect(int distance)
+        {
+            imperfect++;
+            if ((size_t)distance >= distances.size())
+                distances.resize(distance+1, 0);
+            distances[distance]++;
+        }
+
+        void merge(const MatchStats &other)
+        {
+            perfect += other.perfect;
+            imperfect += other.imperfect;
+            unmatched += other.unmatched;
+            if (distances.size() < other.distances.size())
+                distances.resize(other.distances.size(), 0);
+            for (size_t d = 0; d < other.distances.size(); d++)
+                distances[d] += other.distances[d];
+        }
+    };
+}
+#endif